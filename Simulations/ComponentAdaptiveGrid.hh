@@ -0,0 +1,594 @@
+#ifndef COMPONENT_ADAPTIVE_GRID_HH
+#define COMPONENT_ADAPTIVE_GRID_HH
+
+// Potential and field of another component, resampled onto a two-level
+// regular grid.
+//
+// The area is covered by a coarse grid of nx * ny * nz cells. A coarse cell
+// is split into refine^3 fine cells when trilinear interpolation misses the
+// field at its centre by more than the tolerance, when it touches a
+// material boundary (electrodes, grid wires) or when it lies inside a
+// region added with AddRefinementRegion(). A field lookup is then two
+// divisions and one trilinear interpolation instead of a search through
+// the tetrahedral mesh.
+//
+// Build() samples one source per thread (see DriftEngine.hh); with a
+// single source it runs on one thread. The finished grid is read-only and
+// can be shared between threads.
+//
+// Usage:
+//   ComponentAdaptiveGrid grid;
+//   grid.Build(pumaModel, -3, -3, -15, 3, 3, 5, 60, 60, 200, 4, 1e-3);
+//   grid.Validate(pumaModel, 100000);
+//   grid.Save("puma.grid");
+//   ...
+//   grid.Load("puma.grid");
+//   grid.SetGas(&gas);
+//   sensor.AddComponent(&grid);
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Garfield/Component.hh"
+#include "Garfield/Medium.hh"
+
+class ComponentAdaptiveGrid : public Garfield::Component {
+ public:
+  ComponentAdaptiveGrid() : Component("AdaptiveGrid") {}
+  ~ComponentAdaptiveGrid() {}
+
+  // Medium used wherever the source component had a drift medium.
+  void SetGas(Garfield::Medium* medium) { m_medium = medium; }
+
+  // Always refine the coarse cells overlapping this box [cm].
+  void AddRefinementRegion(const double x0, const double y0, const double z0,
+                           const double x1, const double y1, const double z1) {
+    m_regions.push_back({x0, y0, z0, x1, y1, z1});
+  }
+
+  // Samples the source component on the grid. tolerance is the allowed
+  // relative error of |E| at the centre of an unrefined cell.
+  bool Build(Garfield::Component& source, const double xmin,
+             const double ymin, const double zmin, const double xmax,
+             const double ymax, const double zmax, const size_t nx,
+             const size_t ny, const size_t nz, const size_t refine,
+             const double tolerance) {
+    return Build(std::vector<Garfield::Component*>{&source}, xmin, ymin, zmin,
+                 xmax, ymax, zmax, nx, ny, nz, refine, tolerance);
+  }
+
+  // Same, with one copy of the source per thread (at most nThreads).
+  bool Build(const std::vector<Garfield::Component*>& sources,
+             const double xmin, const double ymin, const double zmin,
+             const double xmax, const double ymax, const double zmax,
+             const size_t nx, const size_t ny, const size_t nz,
+             const size_t refine, const double tolerance,
+             unsigned int nThreads = 0);
+
+  // Compares the grid with the source at nPoints random points in a drift
+  // medium and prints the deviations and evaluation rates. Returns the
+  // largest relative deviation of |E|.
+  double Validate(Garfield::Component& source, const size_t nPoints,
+                  const unsigned int seed = 1);
+
+  bool Save(const std::string& file) const;
+  bool Load(const std::string& file);
+
+  size_t GetNumberOfRefinedCells() const { return m_nRefined; }
+
+  Garfield::Medium* GetMedium(const double x, const double y,
+                              const double z) override {
+    double s[4];
+    return Evaluate(x, y, z, s) == 0 ? m_medium : nullptr;
+  }
+
+  void ElectricField(const double x, const double y, const double z,
+                     double& ex, double& ey, double& ez, Garfield::Medium*& m,
+                     int& status) override {
+    double v = 0.;
+    ElectricField(x, y, z, ex, ey, ez, v, m, status);
+  }
+
+  void ElectricField(const double x, const double y, const double z,
+                     double& ex, double& ey, double& ez, double& v,
+                     Garfield::Medium*& m, int& status) override {
+    double s[4];
+    status = Evaluate(x, y, z, s);
+    v = s[0];
+    ex = s[1];
+    ey = s[2];
+    ez = s[3];
+    m = status == 0 ? m_medium : nullptr;
+  }
+
+  bool GetVoltageRange(double& vmin, double& vmax) override {
+    if (!m_ready) return false;
+    vmin = m_vmin;
+    vmax = m_vmax;
+    return true;
+  }
+
+  bool GetBoundingBox(double& xmin, double& ymin, double& zmin, double& xmax,
+                      double& ymax, double& zmax) override {
+    if (!m_ready) return false;
+    xmin = m_min[0];
+    ymin = m_min[1];
+    zmin = m_min[2];
+    xmax = m_max[0];
+    ymax = m_max[1];
+    zmax = m_max[2];
+    return true;
+  }
+
+ protected:
+  void Reset() override {
+    m_coarse.clear();
+    m_fine.clear();
+    m_block.clear();
+    m_status.clear();
+    m_fineStatus.clear();
+    m_nRefined = 0;
+    m_ready = false;
+  }
+  void UpdatePeriodicity() override {}
+
+ private:
+  // Potential and field at a node, padded to one cache-aligned vector.
+  struct alignas(32) Sample {
+    double s[4];  // V, Ex, Ey, Ez
+  };
+
+  Garfield::Medium* m_medium = nullptr;
+  std::vector<std::array<double, 6> > m_regions;
+
+  double m_min[3] = {0, 0, 0};
+  double m_max[3] = {0, 0, 0};
+  double m_step[3] = {1, 1, 1};
+  size_t m_n[3] = {0, 0, 0};
+  size_t m_refine = 1;
+  size_t m_nRefined = 0;
+  double m_vmin = 0., m_vmax = 0.;
+
+  // Coarse nodes, x fastest.
+  std::vector<Sample> m_coarse;
+  // Per coarse cell: index of its fine block, or -1.
+  std::vector<int32_t> m_block;
+  // Per coarse cell: status of the source at the cell centre.
+  std::vector<int8_t> m_status;
+  // Fine blocks of (refine + 1)^3 nodes and refine^3 cell statuses.
+  std::vector<Sample> m_fine;
+  std::vector<int8_t> m_fineStatus;
+
+  size_t CoarseNode(const size_t i, const size_t j, const size_t k) const {
+    return i + (m_n[0] + 1) * (j + (m_n[1] + 1) * k);
+  }
+  size_t CoarseCell(const size_t i, const size_t j, const size_t k) const {
+    return i + m_n[0] * (j + m_n[1] * k);
+  }
+
+  // Trilinear interpolation in a box of nodes with strides (1, sy, sz).
+  // The four quantities of a node are summed as one vector.
+  static void Trilinear(const Sample* p, const size_t sy, const size_t sz,
+                        const double u, const double v, const double w,
+                        double out[4]) {
+    const double wt[8] = {(1 - u) * (1 - v) * (1 - w), u * (1 - v) * (1 - w),
+                          (1 - u) * v * (1 - w),       u * v * (1 - w),
+                          (1 - u) * (1 - v) * w,       u * (1 - v) * w,
+                          (1 - u) * v * w,             u * v * w};
+    const Sample* c[8] = {p,          p + 1,           p + sy,
+                          p + sy + 1, p + sz,          p + sz + 1,
+                          p + sz + sy, p + sz + sy + 1};
+    double acc[4] = {0., 0., 0., 0.};
+    for (size_t n = 0; n < 8; ++n) {
+      for (size_t q = 0; q < 4; ++q) acc[q] += wt[n] * c[n]->s[q];
+    }
+    for (size_t q = 0; q < 4; ++q) out[q] = acc[q];
+  }
+
+  // Returns the status and fills (V, Ex, Ey, Ez).
+  int Evaluate(const double x, const double y, const double z,
+               double out[4]) const {
+    out[0] = out[1] = out[2] = out[3] = 0.;
+    if (!m_ready) return -10;
+    const double p[3] = {x, y, z};
+    size_t idx[3];
+    double frac[3];
+    for (size_t a = 0; a < 3; ++a) {
+      if (p[a] < m_min[a] || p[a] > m_max[a]) return -6;
+      const double f = (p[a] - m_min[a]) / m_step[a];
+      idx[a] = std::min(static_cast<size_t>(f), m_n[a] - 1);
+      frac[a] = f - idx[a];
+    }
+    const size_t cell = CoarseCell(idx[0], idx[1], idx[2]);
+    const int32_t b = m_block[cell];
+    if (b < 0) {
+      Trilinear(&m_coarse[CoarseNode(idx[0], idx[1], idx[2])], m_n[0] + 1,
+                (m_n[0] + 1) * (m_n[1] + 1), frac[0], frac[1], frac[2], out);
+      return m_status[cell];
+    }
+    const size_t r = m_refine;
+    const size_t r1 = r + 1;
+    size_t fi[3];
+    for (size_t a = 0; a < 3; ++a) {
+      const double f = frac[a] * r;
+      fi[a] = std::min(static_cast<size_t>(f), r - 1);
+      frac[a] = f - fi[a];
+    }
+    const Sample* block = &m_fine[size_t(b) * r1 * r1 * r1];
+    Trilinear(block + fi[0] + r1 * (fi[1] + r1 * fi[2]), r1, r1 * r1, frac[0],
+              frac[1], frac[2], out);
+    const size_t cellIndex = fi[0] + r * (fi[1] + r * fi[2]);
+    return m_fineStatus[size_t(b) * r * r * r + cellIndex];
+  }
+
+  static int SampleSource(Garfield::Component& source, const double x,
+                          const double y, const double z, Sample& s) {
+    Garfield::Medium* m = nullptr;
+    int status = 0;
+    source.ElectricField(x, y, z, s.s[1], s.s[2], s.s[3], s.s[0], m, status);
+    return status;
+  }
+
+  // Size of a grid file with the given header dimensions, or 0 if they are
+  // invalid.
+  static uint64_t ExpectedFileSize(const uint64_t dims[6]) {
+    const uint64_t limit = uint64_t(1) << 40;
+    for (size_t a = 0; a < 4; ++a) {
+      if (dims[a] == 0 || dims[a] >= (uint64_t(1) << 20)) return 0;
+    }
+    const uint64_t r = dims[3];
+    const uint64_t nCells = dims[0] * dims[1] * dims[2];
+    const uint64_t nNodes = (dims[0] + 1) * (dims[1] + 1) * (dims[2] + 1);
+    if (nCells > limit || dims[4] > nCells ||
+        dims[4] > uint64_t(INT32_MAX) || r * r * r > limit / (dims[4] + 1)) {
+      return 0;
+    }
+    const uint64_t nFine = dims[4] * (r + 1) * (r + 1) * (r + 1);
+    return 8 + 6 * sizeof(uint64_t) + 8 * sizeof(double) +
+           nNodes * sizeof(Sample) + nCells * (sizeof(int32_t) + 1) +
+           nFine * sizeof(Sample) + dims[4] * r * r * r;
+  }
+
+  static uint64_t FileSize(FILE* f) {
+    const long pos = std::ftell(f);
+    if (pos < 0 || std::fseek(f, 0, SEEK_END) != 0) return 0;
+    const long size = std::ftell(f);
+    if (std::fseek(f, pos, SEEK_SET) != 0 || size < 0) return 0;
+    return uint64_t(size);
+  }
+
+  static int8_t ClampStatus(const int status) {
+    return static_cast<int8_t>(std::max(-127, std::min(127, status)));
+  }
+
+  // Runs f(i, k) for i in [0, n) on nThreads threads; k is the thread.
+  template <typename F>
+  static void ParallelFor(const size_t n, unsigned int nThreads, F f) {
+    nThreads = std::max<size_t>(1, std::min<size_t>(nThreads, n));
+    std::atomic<size_t> next(0);
+    auto worker = [&](const unsigned int k) {
+      for (size_t i = next++; i < n; i = next++) f(i, k);
+    };
+    std::vector<std::thread> pool;
+    for (unsigned int k = 1; k < nThreads; ++k) pool.emplace_back(worker, k);
+    worker(0);
+    for (auto& t : pool) t.join();
+  }
+};
+
+inline bool ComponentAdaptiveGrid::Build(
+    const std::vector<Garfield::Component*>& sources, const double xmin,
+    const double ymin, const double zmin, const double xmax, const double ymax,
+    const double zmax, const size_t nx, const size_t ny, const size_t nz,
+    const size_t refine, const double tolerance, unsigned int nThreads) {
+  if (nx == 0 || ny == 0 || nz == 0 || refine == 0 || xmax <= xmin ||
+      ymax <= ymin || zmax <= zmin) {
+    std::cerr << "ComponentAdaptiveGrid::Build: Invalid grid.\n";
+    return false;
+  }
+  if (sources.empty()) {
+    std::cerr << "ComponentAdaptiveGrid::Build: No source.\n";
+    return false;
+  }
+  if (nThreads == 0) nThreads = std::thread::hardware_concurrency();
+  nThreads = std::min<size_t>(nThreads, sources.size());
+  Reset();
+  const auto t0 = std::chrono::steady_clock::now();
+  m_min[0] = xmin;
+  m_min[1] = ymin;
+  m_min[2] = zmin;
+  m_max[0] = xmax;
+  m_max[1] = ymax;
+  m_max[2] = zmax;
+  m_n[0] = nx;
+  m_n[1] = ny;
+  m_n[2] = nz;
+  for (size_t a = 0; a < 3; ++a) m_step[a] = (m_max[a] - m_min[a]) / m_n[a];
+  m_refine = refine;
+
+  // Coarse nodes, one z plane per task.
+  const size_t nxp = nx + 1, nyp = ny + 1;
+  m_coarse.resize(nxp * nyp * (nz + 1));
+  std::vector<int8_t> nodeStatus(m_coarse.size());
+  ParallelFor(nz + 1, nThreads, [&](const size_t k, const unsigned int t) {
+    Garfield::Component& source = *sources[t];
+    for (size_t j = 0; j < nyp; ++j) {
+      for (size_t i = 0; i < nxp; ++i) {
+        const size_t n = CoarseNode(i, j, k);
+        nodeStatus[n] = ClampStatus(
+            SampleSource(source, xmin + i * m_step[0], ymin + j * m_step[1],
+                         zmin + k * m_step[2], m_coarse[n]));
+      }
+    }
+  });
+
+  // Decide which cells to refine.
+  const size_t nCells = nx * ny * nz;
+  m_status.resize(nCells);
+  std::vector<char> split(nCells, 0);
+  ParallelFor(nz, nThreads, [&](const size_t k, const unsigned int t) {
+    Garfield::Component& source = *sources[t];
+    const double eFloor = 1.e-6;
+    for (size_t j = 0; j < ny; ++j) {
+      for (size_t i = 0; i < nx; ++i) {
+        const size_t c = CoarseCell(i, j, k);
+        const double x0 = xmin + i * m_step[0];
+        const double y0 = ymin + j * m_step[1];
+        const double z0 = zmin + k * m_step[2];
+        Sample centre;
+        const int status =
+            SampleSource(source, x0 + 0.5 * m_step[0], y0 + 0.5 * m_step[1],
+                         z0 + 0.5 * m_step[2], centre);
+        m_status[c] = ClampStatus(status);
+        // Material boundary inside the cell?
+        bool mixed = false;
+        const size_t n0 = CoarseNode(i, j, k);
+        const size_t corners[8] = {n0,
+                                   n0 + 1,
+                                   n0 + nxp,
+                                   n0 + nxp + 1,
+                                   n0 + nxp * nyp,
+                                   n0 + nxp * nyp + 1,
+                                   n0 + nxp * nyp + nxp,
+                                   n0 + nxp * nyp + nxp + 1};
+        for (size_t n : corners) {
+          if (nodeStatus[n] != m_status[c]) mixed = true;
+        }
+        bool forced = false;
+        for (const auto& r : m_regions) {
+          if (x0 + m_step[0] >= r[0] && x0 <= r[3] &&
+              y0 + m_step[1] >= r[1] && y0 <= r[4] &&
+              z0 + m_step[2] >= r[2] && z0 <= r[5]) {
+            forced = true;
+          }
+        }
+        bool inaccurate = false;
+        if (!mixed && status == 0) {
+          double s[4];
+          Trilinear(&m_coarse[n0], nxp, nxp * nyp, 0.5, 0.5, 0.5, s);
+          const double e0 = std::sqrt(centre.s[1] * centre.s[1] +
+                                      centre.s[2] * centre.s[2] +
+                                      centre.s[3] * centre.s[3]);
+          const double dx = s[1] - centre.s[1];
+          const double dy = s[2] - centre.s[2];
+          const double dz = s[3] - centre.s[3];
+          const double de = std::sqrt(dx * dx + dy * dy + dz * dz);
+          inaccurate = de > tolerance * std::max(e0, eFloor);
+        }
+        split[c] = (mixed || forced || inaccurate) && refine > 1;
+      }
+    }
+  });
+
+  // Number the refined cells in cell order, so the layout does not depend
+  // on the thread count.
+  m_block.assign(nCells, -1);
+  for (size_t c = 0; c < nCells; ++c) {
+    if (split[c]) m_block[c] = static_cast<int32_t>(m_nRefined++);
+  }
+
+  const size_t r = refine, r1 = refine + 1;
+  m_fine.resize(m_nRefined * r1 * r1 * r1);
+  m_fineStatus.resize(m_nRefined * r * r * r);
+  ParallelFor(nCells, nThreads, [&](const size_t c, const unsigned int t) {
+    if (m_block[c] < 0) return;
+    Garfield::Component& source = *sources[t];
+    const size_t i = c % nx, j = (c / nx) % ny, k = c / (nx * ny);
+    const double x0 = xmin + i * m_step[0];
+    const double y0 = ymin + j * m_step[1];
+    const double z0 = zmin + k * m_step[2];
+    const double h[3] = {m_step[0] / r, m_step[1] / r, m_step[2] / r};
+    Sample* block = &m_fine[size_t(m_block[c]) * r1 * r1 * r1];
+    int8_t* status = &m_fineStatus[size_t(m_block[c]) * r * r * r];
+    for (size_t kk = 0; kk < r1; ++kk) {
+      for (size_t jj = 0; jj < r1; ++jj) {
+        for (size_t ii = 0; ii < r1; ++ii) {
+          SampleSource(source, x0 + ii * h[0], y0 + jj * h[1], z0 + kk * h[2],
+                       block[ii + r1 * (jj + r1 * kk)]);
+          if (ii == r || jj == r || kk == r) continue;
+          Sample centre;
+          status[ii + r * (jj + r * kk)] = ClampStatus(SampleSource(
+              source, x0 + (ii + 0.5) * h[0], y0 + (jj + 0.5) * h[1],
+              z0 + (kk + 0.5) * h[2], centre));
+        }
+      }
+    }
+  });
+
+  m_vmin = m_vmax = m_coarse[0].s[0];
+  for (size_t n = 0; n < m_coarse.size(); ++n) {
+    if (nodeStatus[n] != 0) continue;
+    m_vmin = std::min(m_vmin, m_coarse[n].s[0]);
+    m_vmax = std::max(m_vmax, m_coarse[n].s[0]);
+  }
+  m_ready = true;
+
+  const double seconds = std::chrono::duration<double>(
+                             std::chrono::steady_clock::now() - t0).count();
+  const double mb =
+      (m_coarse.size() + m_fine.size()) * sizeof(Sample) / (1024. * 1024.);
+  std::cout << "ComponentAdaptiveGrid::Build: " << nCells << " cells, "
+            << m_nRefined << " refined " << r << "^3, " << mb << " MB, "
+            << seconds << " s on " << nThreads << " threads.\n";
+  return true;
+}
+
+inline double ComponentAdaptiveGrid::Validate(Garfield::Component& source,
+                                              const size_t nPoints,
+                                              const unsigned int seed) {
+  std::mt19937 gen(seed);
+  std::uniform_real_distribution<double> ux(m_min[0], m_max[0]);
+  std::uniform_real_distribution<double> uy(m_min[1], m_max[1]);
+  std::uniform_real_distribution<double> uz(m_min[2], m_max[2]);
+  std::vector<std::array<double, 3> > points(nPoints);
+  for (auto& p : points) p = {ux(gen), uy(gen), uz(gen)};
+
+  // Reference values and timing of the source.
+  std::vector<Sample> ref(nPoints);
+  std::vector<int> refStatus(nPoints);
+  auto t0 = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < nPoints; ++i) {
+    refStatus[i] =
+        SampleSource(source, points[i][0], points[i][1], points[i][2], ref[i]);
+  }
+  const double tSource = std::chrono::duration<double>(
+                             std::chrono::steady_clock::now() - t0).count();
+
+  std::vector<Sample> grid(nPoints);
+  t0 = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < nPoints; ++i) {
+    Evaluate(points[i][0], points[i][1], points[i][2], grid[i].s);
+  }
+  const double tGrid = std::chrono::duration<double>(
+                           std::chrono::steady_clock::now() - t0).count();
+
+  double maxRel = 0., maxAbs = 0., maxV = 0., sumRel = 0.;
+  size_t nUsed = 0;
+  for (size_t i = 0; i < nPoints; ++i) {
+    if (refStatus[i] != 0) continue;
+    const double* a = ref[i].s;
+    const double* b = grid[i].s;
+    const double e0 = std::sqrt(a[1] * a[1] + a[2] * a[2] + a[3] * a[3]);
+    const double de = std::sqrt((b[1] - a[1]) * (b[1] - a[1]) +
+                                (b[2] - a[2]) * (b[2] - a[2]) +
+                                (b[3] - a[3]) * (b[3] - a[3]));
+    maxAbs = std::max(maxAbs, de);
+    maxV = std::max(maxV, std::abs(b[0] - a[0]));
+    if (e0 > 0.) {
+      maxRel = std::max(maxRel, de / e0);
+      sumRel += de / e0;
+    }
+    ++nUsed;
+  }
+  std::cout << "ComponentAdaptiveGrid::Validate: " << nUsed
+            << " points in a drift medium.\n"
+            << "    max |dE|/|E|   " << maxRel << "\n"
+            << "    mean |dE|/|E|  " << (nUsed ? sumRel / nUsed : 0.) << "\n"
+            << "    max |dE|       " << maxAbs << " V/cm\n"
+            << "    max |dV|       " << maxV << " V\n"
+            << "    source         " << nPoints / tSource << " evaluations/s\n"
+            << "    grid           " << nPoints / tGrid << " evaluations/s ("
+            << tSource / tGrid << "x)\n";
+  return maxRel;
+}
+
+inline bool ComponentAdaptiveGrid::Save(const std::string& file) const {
+  if (!m_ready) return false;
+  FILE* f = std::fopen(file.c_str(), "wb");
+  if (!f) {
+    std::cerr << "ComponentAdaptiveGrid::Save: Cannot open " << file << "\n";
+    return false;
+  }
+  const char magic[8] = {'P', 'U', 'M', 'A', 'G', 'R', 'I', 'D'};
+  const uint64_t dims[6] = {m_n[0], m_n[1], m_n[2], m_refine, m_nRefined, 1};
+  bool ok = std::fwrite(magic, 1, 8, f) == 8;
+  ok = ok && std::fwrite(dims, sizeof(uint64_t), 6, f) == 6;
+  ok = ok && std::fwrite(m_min, sizeof(double), 3, f) == 3;
+  ok = ok && std::fwrite(m_max, sizeof(double), 3, f) == 3;
+  ok = ok && std::fwrite(&m_vmin, sizeof(double), 1, f) == 1;
+  ok = ok && std::fwrite(&m_vmax, sizeof(double), 1, f) == 1;
+  ok = ok && std::fwrite(m_coarse.data(), sizeof(Sample), m_coarse.size(),
+                         f) == m_coarse.size();
+  ok = ok && std::fwrite(m_block.data(), sizeof(int32_t), m_block.size(), f) ==
+                 m_block.size();
+  ok = ok && std::fwrite(m_status.data(), 1, m_status.size(), f) ==
+                 m_status.size();
+  ok = ok && std::fwrite(m_fine.data(), sizeof(Sample), m_fine.size(), f) ==
+                 m_fine.size();
+  ok = ok && std::fwrite(m_fineStatus.data(), 1, m_fineStatus.size(), f) ==
+                 m_fineStatus.size();
+  ok = (std::fclose(f) == 0) && ok;
+  if (!ok) {
+    std::cerr << "ComponentAdaptiveGrid::Save: Error writing " << file << "\n";
+  }
+  return ok;
+}
+
+inline bool ComponentAdaptiveGrid::Load(const std::string& file) {
+  Reset();
+  FILE* f = std::fopen(file.c_str(), "rb");
+  if (!f) {
+    std::cerr << "ComponentAdaptiveGrid::Load: Cannot open " << file << "\n";
+    return false;
+  }
+  char magic[8];
+  uint64_t dims[6];
+  bool ok = std::fread(magic, 1, 8, f) == 8 &&
+            std::memcmp(magic, "PUMAGRID", 8) == 0 &&
+            std::fread(dims, sizeof(uint64_t), 6, f) == 6 && dims[5] == 1;
+  // Check the dimensions against the file size before allocating.
+  ok = ok && ExpectedFileSize(dims) == FileSize(f);
+  if (ok) {
+    for (size_t a = 0; a < 3; ++a) m_n[a] = dims[a];
+    m_refine = dims[3];
+    m_nRefined = dims[4];
+    const size_t r = m_refine;
+    m_coarse.resize((m_n[0] + 1) * (m_n[1] + 1) * (m_n[2] + 1));
+    m_block.resize(m_n[0] * m_n[1] * m_n[2]);
+    m_status.resize(m_block.size());
+    m_fine.resize(m_nRefined * (r + 1) * (r + 1) * (r + 1));
+    m_fineStatus.resize(m_nRefined * r * r * r);
+    ok = std::fread(m_min, sizeof(double), 3, f) == 3 &&
+         std::fread(m_max, sizeof(double), 3, f) == 3 &&
+         std::fread(&m_vmin, sizeof(double), 1, f) == 1 &&
+         std::fread(&m_vmax, sizeof(double), 1, f) == 1 &&
+         std::fread(m_coarse.data(), sizeof(Sample), m_coarse.size(), f) ==
+             m_coarse.size() &&
+         std::fread(m_block.data(), sizeof(int32_t), m_block.size(), f) ==
+             m_block.size() &&
+         std::fread(m_status.data(), 1, m_status.size(), f) ==
+             m_status.size() &&
+         std::fread(m_fine.data(), sizeof(Sample), m_fine.size(), f) ==
+             m_fine.size() &&
+         std::fread(m_fineStatus.data(), 1, m_fineStatus.size(), f) ==
+             m_fineStatus.size();
+  }
+  std::fclose(f);
+  // Every refined cell must point to a block in the file.
+  for (size_t c = 0; ok && c < m_block.size(); ++c) {
+    ok = m_block[c] >= -1 && (m_block[c] < 0 || size_t(m_block[c]) < m_nRefined);
+  }
+  for (size_t a = 0; ok && a < 3; ++a) ok = m_max[a] > m_min[a];
+  if (!ok) {
+    std::cerr << "ComponentAdaptiveGrid::Load: " << file
+              << " is not a valid grid file.\n";
+    Reset();
+    return false;
+  }
+  for (size_t a = 0; a < 3; ++a) m_step[a] = (m_max[a] - m_min[a]) / m_n[a];
+  m_ready = true;
+  return true;
+}
+
+#endif
@@ -0,0 +1,161 @@
+#ifndef COMPONENT_SUPERPOSITION_HH
+#define COMPONENT_SUPERPOSITION_HH
+
+// COMSOL field map built from one unit-potential solution per electrode.
+//
+// The problem is electrostatic and linear, so the potential for any set of
+// electrode voltages is V = sum_i V_i * phi_i, where phi_i is the solution
+// with electrode i at 1 V and all others at 0 V. All solutions are loaded
+// once on the shared mesh, and cached with it (see ComsolCache.hh);
+// SetVoltage() then rebuilds the nodal potentials
+// in one pass over the nodes, and field lookups cost the same as for a
+// single COMSOL export.
+//
+// Usage:
+//   ComponentSuperposition model;
+//   model.Initialise("mesh.mphtxt", "dielectric_py.txt",
+//                    {{"cathode", "unit_cathode.txt"},
+//                     {"grid", "unit_grid.txt"},
+//                     {"anode", "unit_anode.txt"}}, "mm");
+//   model.SetVoltage("cathode", -1700.);
+//   model.SetVoltage("grid", 8.);
+//   model.SetVoltage("anode", 16.);
+//
+// The unit solution of an electrode is also its weighting potential, so
+// every electrode label can be passed to WeightingPotential(), e.g. for
+// signals (see SignalSynthesis.hh).
+//
+// Voltages must not be changed while electrons are being drifted.
+
+#include <algorithm>
+#include <iostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "ComsolCache.hh"
+
+class ComponentSuperposition : public ComponentComsolCached {
+ public:
+  ComponentSuperposition() = default;
+
+  // Loads the mesh and the unit solution of each electrode, given as
+  // (label, potential file) pairs. All voltages start at 0 V.
+  bool Initialise(const std::string& mesh, const std::string& mplist,
+                  const std::vector<std::pair<std::string, std::string> >&
+                      electrodes,
+                  const std::string& unit = "m") {
+    m_labels.clear();
+    m_unit.clear();
+    m_voltages.clear();
+    if (electrodes.empty()) {
+      std::cerr << "ComponentSuperposition::Initialise: No electrodes.\n";
+      return false;
+    }
+    // The mesh is read with the first solution, and every solution as a
+    // weighting potential on that mesh; all of them come from the cache
+    // after the first run.
+    if (!ComponentComsolCached::Initialise(mesh, mplist,
+                                           electrodes[0].second, unit,
+                                           electrodes)) {
+      return false;
+    }
+    for (const auto& electrode : electrodes) {
+      const auto& label = electrode.first;
+      const auto it = m_wpot.find(label);
+      if (it == m_wpot.end()) {
+        std::cerr << "ComponentSuperposition::Initialise: No solution for "
+                  << label << ".\n";
+        return false;
+      }
+      m_labels.push_back(label);
+      m_unit.push_back(it->second);
+    }
+    m_voltages.assign(m_labels.size(), 0.);
+    Update();
+    return true;
+  }
+
+  // Copies another instance, including its voltages.
+  bool CopyFrom(const ComponentSuperposition& other) {
+    if (!ComponentComsolCached::CopyFrom(other)) return false;
+    m_labels = other.m_labels;
+    m_unit = other.m_unit;
+    m_voltages = other.m_voltages;
+    m_vmin = other.m_vmin;
+    m_vmax = other.m_vmax;
+    return true;
+  }
+
+  // Includes the unit solutions.
+  size_t MemoryUsage() const {
+    size_t bytes = ComponentComsolCached::MemoryUsage();
+    for (const auto& u : m_unit) bytes += u.size() * sizeof(double);
+    return bytes;
+  }
+
+  bool SetVoltage(const std::string& label, const double v) {
+    for (size_t i = 0; i < m_labels.size(); ++i) {
+      if (m_labels[i] != label) continue;
+      m_voltages[i] = v;
+      Update();
+      return true;
+    }
+    std::cerr << "ComponentSuperposition::SetVoltage: Unknown electrode "
+              << label << ".\n";
+    return false;
+  }
+
+  // Sets all voltages at once, in the order given to Initialise.
+  bool SetVoltages(const std::vector<double>& v) {
+    if (v.size() != m_labels.size()) {
+      std::cerr << "ComponentSuperposition::SetVoltages: Expected "
+                << m_labels.size() << " voltages.\n";
+      return false;
+    }
+    m_voltages = v;
+    Update();
+    return true;
+  }
+
+  double GetVoltage(const std::string& label) const {
+    for (size_t i = 0; i < m_labels.size(); ++i) {
+      if (m_labels[i] == label) return m_voltages[i];
+    }
+    return 0.;
+  }
+
+  const std::vector<std::string>& GetElectrodes() const { return m_labels; }
+
+  bool GetVoltageRange(double& vmin, double& vmax) override {
+    if (m_pot.empty()) return false;
+    vmin = m_vmin;
+    vmax = m_vmax;
+    return true;
+  }
+
+ private:
+  std::vector<std::string> m_labels;
+  // Nodal unit-potential solution of each electrode.
+  std::vector<std::vector<double> > m_unit;
+  std::vector<double> m_voltages;
+  double m_vmin = 0., m_vmax = 0.;
+
+  // m_pot = sum_i V_i * phi_i.
+  void Update() {
+    const size_t n = m_unit[0].size();
+    m_pot.assign(n, 0.);
+    double* pot = m_pot.data();
+    for (size_t i = 0; i < m_unit.size(); ++i) {
+      const double v = m_voltages[i];
+      if (v == 0.) continue;
+      const double* phi = m_unit[i].data();
+      for (size_t j = 0; j < n; ++j) pot[j] += v * phi[j];
+    }
+    const auto range = std::minmax_element(m_pot.begin(), m_pot.end());
+    m_vmin = n > 0 ? *range.first : 0.;
+    m_vmax = n > 0 ? *range.second : 0.;
+  }
+};
+
+#endif
@@ -0,0 +1,436 @@
+#ifndef COMSOL_CACHE_HH
+#define COMSOL_CACHE_HH
+
+// Binary cache for COMSOL imports.
+//
+// ComponentComsolCached is a drop-in replacement for ComponentComsol. The
+// first Initialise() with a given mesh, materials file, potential file and
+// unit parses the text files as usual and writes the nodes, elements,
+// materials and nodal potentials to a binary file named after a hash of
+// the three inputs and the unit. Later runs mmap that file instead of
+// parsing; editing any input changes the hash and rebuilds the cache.
+// Weighting potentials passed to Initialise() are read on the mesh and
+// stored in the same file, keyed by their files and labels as well.
+//
+// The cache directory is, in order of preference, the one given to
+// SetCacheDirectory(), $PUMA_COMSOL_CACHE, or the directory of the mesh.
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "Garfield/ComponentComsol.hh"
+
+namespace ComsolCache {
+
+constexpr char kMagic[8] = {'P', 'U', 'M', 'A', 'C', 'O', 'M', 'S'};
+// Version 2: every section starts at a multiple of 8 bytes.
+// Version 3: weighting potentials.
+constexpr uint32_t kVersion = 3;
+
+// Size of a section of n values of type T, padded to 8 bytes so that the
+// next section is aligned in the mapping.
+template <typename T>
+constexpr size_t sectionSize(const uint64_t n) {
+  return (n * sizeof(T) + 7) & ~size_t(7);
+}
+
+struct Header {
+  char magic[8];
+  uint32_t version;
+  uint32_t nodesPerElement;
+  uint64_t key;
+  uint64_t nNodes;
+  uint64_t nElements;
+  uint64_t nMaterials;
+  uint64_t nPotentials;
+  uint64_t nWeighting;
+};
+static_assert(sizeof(Header) % 8 == 0, "sections must stay aligned");
+
+// Read-only mapping of a whole file.
+class MappedFile {
+ public:
+  explicit MappedFile(const std::string& path) {
+    m_fd = open(path.c_str(), O_RDONLY);
+    if (m_fd < 0) return;
+    struct stat st;
+    if (fstat(m_fd, &st) != 0 || st.st_size == 0) return;
+    m_size = st.st_size;
+    void* p = mmap(nullptr, m_size, PROT_READ, MAP_SHARED, m_fd, 0);
+    if (p == MAP_FAILED) {
+      m_size = 0;
+      return;
+    }
+    m_data = static_cast<const char*>(p);
+    madvise(p, m_size, MADV_SEQUENTIAL);
+  }
+  ~MappedFile() {
+    if (m_data) munmap(const_cast<char*>(m_data), m_size);
+    if (m_fd >= 0) close(m_fd);
+  }
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  const char* data() const { return m_data; }
+  size_t size() const { return m_size; }
+
+ private:
+  int m_fd = -1;
+  size_t m_size = 0;
+  const char* m_data = nullptr;
+};
+
+// 64-bit hash, consuming eight bytes per step so that hashing a large
+// mesh costs far less than parsing it.
+inline uint64_t hashBytes(const char* p, const size_t n, uint64_t h) {
+  constexpr uint64_t prime = 0x100000001b3ULL;
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    uint64_t w;
+    std::memcpy(&w, p + i, 8);
+    h = (h ^ w) * prime;
+    h ^= h >> 29;
+  }
+  for (; i < n; ++i) h = (h ^ static_cast<unsigned char>(p[i])) * prime;
+  return h ^ n;
+}
+
+// Key of a set of COMSOL inputs and of the other import settings (unit,
+// weighting potential labels) in tag; returns false if a file can't be
+// read.
+inline bool inputKey(const std::vector<std::string>& files,
+                     const std::string& tag, uint64_t& key) {
+  key = 0xcbf29ce484222325ULL ^ kVersion;
+  for (const auto& file : files) {
+    MappedFile f(file);
+    if (!f.data()) return false;
+    key = hashBytes(f.data(), f.size(), key);
+  }
+  key = hashBytes(tag.data(), tag.size(), key);
+  return true;
+}
+
+inline std::string cacheFileName(const std::string& dir, const uint64_t key) {
+  char name[32];
+  std::snprintf(name, sizeof(name), "comsol_%016llx.bin",
+                static_cast<unsigned long long>(key));
+  return dir + "/" + name;
+}
+
+}  // namespace ComsolCache
+
+class ComponentComsolCached : public Garfield::ComponentComsol {
+ public:
+  ComponentComsolCached() = default;
+
+  void SetCacheDirectory(const std::string& dir) { m_cacheDir = dir; }
+
+  // Same arguments as ComponentComsol::Initialise, plus weighting
+  // potentials given as (label, potential file) pairs, which are cached
+  // with the mesh.
+  bool Initialise(const std::string& mesh = "mesh.mphtxt",
+                  const std::string& mplist = "dielectrics.dat",
+                  const std::string& field = "field.txt",
+                  const std::string& unit = "m",
+                  const std::vector<std::pair<std::string, std::string> >&
+                      weighting = {}) {
+    m_inputs = {mesh, mplist, field, unit};
+    m_cached = false;
+    std::vector<std::string> files = {mesh, mplist, field};
+    std::string tag = unit;
+    for (const auto& w : weighting) {
+      files.push_back(w.second);
+      tag += '\n' + w.first;
+    }
+    uint64_t key = 0;
+    const bool keyed = ComsolCache::inputKey(files, tag, key);
+    const std::string cache =
+        ComsolCache::cacheFileName(CacheDirectory(mesh), key);
+    if (!keyed) {
+      std::cerr << "ComponentComsolCached::Initialise: Could not read input "
+                << "files, falling back to text import.\n";
+    } else if (Load(cache, key)) {
+      std::cout << "ComponentComsolCached::Initialise: Loaded " << cache
+                << "\n";
+      return true;
+    }
+    if (!ComponentComsol::Initialise(mesh, mplist, field, unit)) return false;
+    for (const auto& w : weighting) {
+      if (!ComponentComsol::SetWeightingPotential(w.second, w.first)) {
+        std::cerr << "ComponentComsolCached::Initialise: Could not load "
+                  << w.second << ".\n";
+        return false;
+      }
+    }
+    if (keyed && Save(cache, key)) {
+      std::cout << "ComponentComsolCached::Initialise: Wrote " << cache
+                << "\n";
+    }
+    return true;
+  }
+
+  // Reads a weighting potential on the mesh. After a cache hit the text
+  // import has not run and ComponentComsol does not know the unit of the
+  // potential files, so the text files are imported first (the weighting
+  // potentials read so far are kept). Pass weighting potentials to
+  // Initialise() instead to have them cached.
+  bool SetWeightingPotential(const std::string& file,
+                             const std::string& label) {
+    if (m_cached) {
+      if (m_inputs.size() != 4) {
+        std::cerr << "ComponentComsolCached::SetWeightingPotential: Unit of "
+                  << file << " unknown; use Initialise().\n";
+        return false;
+      }
+      std::cout << "ComponentComsolCached::SetWeightingPotential: "
+                << "Importing " << m_inputs[0] << " for the unit.\n";
+      auto wpot = m_wpot;
+      if (!ComponentComsol::Initialise(m_inputs[0], m_inputs[1], m_inputs[2],
+                                       m_inputs[3])) {
+        return false;
+      }
+      for (auto& w : wpot) m_wpot[w.first] = std::move(w.second);
+      m_cached = false;
+    }
+    return ComponentComsol::SetWeightingPotential(file, label);
+  }
+
+  // Copies the field map of another instance, without reading any file
+  // (for DriftEngine::makeWorkerCopies).
+  bool CopyFrom(const ComponentComsolCached& other) {
+    if (!other.m_ready) return false;
+    Reset();
+    m_nodes = other.m_nodes;
+    m_elements = other.m_elements;
+    m_materials = other.m_materials;
+    m_pot = other.m_pot;
+    m_wpot = other.m_wpot;
+    m_cacheDir = other.m_cacheDir;
+    m_inputs = other.m_inputs;
+    m_cached = other.m_cached;
+    m_ready = true;
+    Prepare();
+    SetRange();
+    UpdatePeriodicity();
+    return true;
+  }
+
+  // Approximate memory of the field map [bytes]: nodes, elements with their
+  // bounding boxes, materials and potentials. Garfield's search tree comes
+  // on top of this.
+  size_t MemoryUsage() const {
+    size_t bytes = m_nodes.size() * sizeof(Node) +
+                   m_elements.size() * (sizeof(Element) + 6 * sizeof(double)) +
+                   m_materials.size() * sizeof(Material) +
+                   m_pot.size() * sizeof(double);
+    for (const auto& w : m_wpot) bytes += w.second.size() * sizeof(double);
+    return bytes;
+  }
+
+  // Write the current field map to a cache file.
+  bool Save(const std::string& file, const uint64_t key) const {
+    ComsolCache::Header h;
+    std::memcpy(h.magic, ComsolCache::kMagic, 8);
+    h.version = ComsolCache::kVersion;
+    h.nodesPerElement = kNodesPerElement;
+    h.key = key;
+    h.nNodes = m_nodes.size();
+    h.nElements = m_elements.size();
+    h.nMaterials = m_materials.size();
+    h.nPotentials = m_pot.size();
+    h.nWeighting = m_wpot.size();
+
+    // Weighting potentials: label lengths, labels, then one section of
+    // nodal values per label.
+    std::vector<uint64_t> labelSizes;
+    std::string labels;
+    for (const auto& w : m_wpot) {
+      if (w.second.size() != h.nPotentials) {
+        std::cerr << "ComponentComsolCached::Save: Weighting potential "
+                  << w.first << " does not match the mesh.\n";
+        return false;
+      }
+      labelSizes.push_back(w.first.size());
+      labels += w.first;
+    }
+
+    // Column layout: node coordinates, element node maps, element
+    // materials, material properties, nodal potentials.
+    std::vector<double> nodes(3 * h.nNodes);
+    for (size_t i = 0; i < h.nNodes; ++i) {
+      nodes[3 * i] = m_nodes[i].x;
+      nodes[3 * i + 1] = m_nodes[i].y;
+      nodes[3 * i + 2] = m_nodes[i].z;
+    }
+    std::vector<int32_t> emap(kNodesPerElement * h.nElements);
+    std::vector<uint32_t> matmap(h.nElements);
+    for (size_t i = 0; i < h.nElements; ++i) {
+      for (size_t j = 0; j < kNodesPerElement; ++j) {
+        emap[kNodesPerElement * i + j] = m_elements[i].emap[j];
+      }
+      matmap[i] = m_elements[i].matmap;
+    }
+    std::vector<double> materials(2 * h.nMaterials);
+    for (size_t i = 0; i < h.nMaterials; ++i) {
+      materials[2 * i] = m_materials[i].eps;
+      materials[2 * i + 1] = m_materials[i].ohm;
+    }
+
+    // Write to a temporary file and rename, so that concurrent jobs never
+    // see a partial cache.
+    const std::string tmp = file + "." + std::to_string(getpid()) + ".tmp";
+    FILE* f = std::fopen(tmp.c_str(), "wb");
+    if (!f) {
+      std::cerr << "ComponentComsolCached::Save: Cannot write " << tmp << "\n";
+      return false;
+    }
+    bool ok = std::fwrite(&h, sizeof(h), 1, f) == 1;
+    ok = ok && Write(f, nodes) && Write(f, emap) && Write(f, matmap);
+    ok = ok && Write(f, materials) && Write(f, m_pot);
+    ok = ok && Write(f, labelSizes) &&
+         Write(f, std::vector<char>(labels.begin(), labels.end()));
+    for (const auto& w : m_wpot) ok = ok && Write(f, w.second);
+    ok = (std::fclose(f) == 0) && ok;
+    if (!ok || std::rename(tmp.c_str(), file.c_str()) != 0) {
+      std::remove(tmp.c_str());
+      std::cerr << "ComponentComsolCached::Save: Error writing " << file
+                << "\n";
+      return false;
+    }
+    return true;
+  }
+
+  // Load a cache file; returns false if it is missing, stale or damaged.
+  bool Load(const std::string& file, const uint64_t key) {
+    ComsolCache::MappedFile f(file);
+    if (!f.data() || f.size() < sizeof(ComsolCache::Header)) return false;
+    ComsolCache::Header h;
+    std::memcpy(&h, f.data(), sizeof(h));
+    if (std::memcmp(h.magic, ComsolCache::kMagic, 8) != 0 ||
+        h.version != ComsolCache::kVersion || h.key != key ||
+        h.nodesPerElement != kNodesPerElement) {
+      return false;
+    }
+    using ComsolCache::sectionSize;
+    const size_t fixed =
+        sizeof(h) + sectionSize<double>(3 * h.nNodes) +
+        sectionSize<int32_t>(kNodesPerElement * h.nElements) +
+        sectionSize<uint32_t>(h.nElements) +
+        sectionSize<double>(2 * h.nMaterials) +
+        sectionSize<double>(h.nPotentials);
+    if (f.size() < fixed || (f.size() - fixed) / 8 < h.nWeighting) {
+      return false;
+    }
+    const uint64_t* labelSizes =
+        reinterpret_cast<const uint64_t*>(f.data() + fixed);
+    uint64_t nLabels = 0;
+    for (size_t i = 0; i < h.nWeighting; ++i) {
+      if (labelSizes[i] > f.size()) return false;
+      nLabels += labelSizes[i];
+    }
+    const size_t expected =
+        fixed + sectionSize<uint64_t>(h.nWeighting) +
+        sectionSize<char>(nLabels) +
+        h.nWeighting * sectionSize<double>(h.nPotentials);
+    if (f.size() != expected) return false;
+
+    // The header is 56 bytes and the sections are padded, so every
+    // section is aligned for its type (the mapping is page aligned).
+    const char* p = f.data() + sizeof(h);
+    const double* nodes = reinterpret_cast<const double*>(p);
+    p += sectionSize<double>(3 * h.nNodes);
+    const int32_t* emap = reinterpret_cast<const int32_t*>(p);
+    p += sectionSize<int32_t>(kNodesPerElement * h.nElements);
+    const uint32_t* matmap = reinterpret_cast<const uint32_t*>(p);
+    p += sectionSize<uint32_t>(h.nElements);
+    const double* materials = reinterpret_cast<const double*>(p);
+    p += sectionSize<double>(2 * h.nMaterials);
+    const double* pot = reinterpret_cast<const double*>(p);
+    p += sectionSize<double>(h.nPotentials) +
+         sectionSize<uint64_t>(h.nWeighting);
+    const char* labels = p;
+    p += sectionSize<char>(nLabels);
+
+    Reset();
+    m_wpot.clear();
+    m_nodes.resize(h.nNodes);
+    for (size_t i = 0; i < h.nNodes; ++i) {
+      m_nodes[i].x = nodes[3 * i];
+      m_nodes[i].y = nodes[3 * i + 1];
+      m_nodes[i].z = nodes[3 * i + 2];
+    }
+    m_elements.resize(h.nElements);
+    for (size_t i = 0; i < h.nElements; ++i) {
+      for (size_t j = 0; j < kNodesPerElement; ++j) {
+        m_elements[i].emap[j] = emap[kNodesPerElement * i + j];
+      }
+      m_elements[i].matmap = matmap[i];
+    }
+    m_materials.resize(h.nMaterials);
+    for (size_t i = 0; i < h.nMaterials; ++i) {
+      m_materials[i].eps = materials[2 * i];
+      m_materials[i].ohm = materials[2 * i + 1];
+      m_materials[i].driftmedium = false;
+      m_materials[i].medium = nullptr;
+    }
+    m_pot.assign(pot, pot + h.nPotentials);
+    for (size_t i = 0; i < h.nWeighting; ++i) {
+      const double* w = reinterpret_cast<const double*>(p);
+      m_wpot[std::string(labels, labelSizes[i])].assign(w, w + h.nPotentials);
+      labels += labelSizes[i];
+      p += sectionSize<double>(h.nPotentials);
+    }
+
+    // Same finishing steps as ComponentComsol::Initialise.
+    m_ready = true;
+    Prepare();
+    SetRange();
+    UpdatePeriodicity();
+    m_cached = true;
+    return true;
+  }
+
+ private:
+  // Quadratic (10-node) tetrahedra.
+  static constexpr size_t kNodesPerElement = 10;
+
+  std::string m_cacheDir;
+  // Text inputs of the last Initialise(): mesh, materials, potential, unit.
+  std::vector<std::string> m_inputs;
+  // Whether the field map came from a cache file.
+  bool m_cached = false;
+
+  std::string CacheDirectory(const std::string& mesh) const {
+    if (!m_cacheDir.empty()) return m_cacheDir;
+    const char* env = std::getenv("PUMA_COMSOL_CACHE");
+    if (env && *env) return env;
+    const auto slash = mesh.find_last_of('/');
+    return slash == std::string::npos ? "." : mesh.substr(0, slash);
+  }
+
+  // Writes a section, padded with zeros to a multiple of 8 bytes.
+  template <typename T>
+  static bool Write(FILE* f, const std::vector<T>& v) {
+    if (v.empty()) return true;
+    if (std::fwrite(v.data(), sizeof(T), v.size(), f) != v.size()) {
+      return false;
+    }
+    const char zeros[8] = {};
+    const size_t pad =
+        ComsolCache::sectionSize<T>(v.size()) - v.size() * sizeof(T);
+    return pad == 0 || std::fwrite(zeros, 1, pad, f) == pad;
+  }
+};
+
+#endif
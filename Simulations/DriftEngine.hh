@@ -0,0 +1,372 @@
+#ifndef DRIFT_ENGINE_HH
+#define DRIFT_ENGINE_HH
+
+// Shared drift driver for the DriftLineRKF programs.
+//
+// The TrackHeed clusters of every track are generated first, then the
+// electrons are drifted on a pool of worker threads. Each worker owns its
+// own Sensor, DriftLineRKF and hSpeed histogram. Every track draws from its
+// own RNG stream seeded from (seed, track index), so a fixed seed gives the
+// same output for any number of threads.
+//
+// Garfield's field maps (ComponentFieldMap) remember the last element found
+// in a plain member that every field lookup writes, so a mesh component
+// must not be shared between threads. Either each worker gets its own copy
+// (makeWorkerCopies), or the model is marked as safe to share
+// (settings.sharedModel, e.g. for ComponentAdaptiveGrid, whose lookups do
+// not write anything); otherwise the electrons are drifted on one thread.
+// A copy holds the whole mesh and builds its own search tree, so n threads
+// need about n times the memory of one model: by default makeWorkerCopies
+// only makes as many copies as fit in half the available memory, and run()
+// reports the memory they use. Where its accuracy is enough, the shared
+// grid is the cheaper choice on many cores.
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+#include <TH1F.h>
+#include <TROOT.h>
+#include "Garfield/Component.hh"
+#include "Garfield/DriftLineRKF.hh"
+#include "Garfield/Random.hh"
+#include "Garfield/Sensor.hh"
+#include "Garfield/TrackHeed.hh"
+#include "Garfield/ViewDrift.hh"
+
+#include "SignalSynthesis.hh"
+#include "TrackRecorder.hh"
+
+namespace DriftEngine {
+
+struct Settings {
+  int nTracks = 150;
+  double z0 = 4.32;                  // track start [cm]
+  double energy = 1e6;               // [eV]
+  std::string particle = "e-";
+  double area[6] = {-3, -3, -15, 3, 3, 5};  // sensor area [cm]
+  unsigned int seed = 1;
+  unsigned int nThreads = 0;         // 0 -> all hardware threads
+  bool debug = false;
+  // One model per worker thread (see makeWorkerCopies); limits the number
+  // of threads. If empty, the model passed to driftElectrons is used on one
+  // thread, or on all of them if sharedModel is set.
+  std::vector<Garfield::Component*> workerModels;
+  bool sharedModel = false;
+  // Approximate memory of one worker model [bytes], for the report.
+  size_t workerModelBytes = 0;
+};
+
+// Number of drift threads for the given settings.
+inline unsigned int threadCount(const Settings& settings) {
+  unsigned int n = settings.nThreads;
+  if (n == 0) n = std::thread::hardware_concurrency();
+  if (!settings.workerModels.empty()) {
+    n = std::min<size_t>(n, settings.workerModels.size());
+  } else if (!settings.sharedModel) {
+    n = 1;
+  }
+  return std::max(1u, n);
+}
+
+// Copies model once per drift thread, with medium as the drift medium,
+// and registers the copies in settings.workerModels. T needs CopyFrom()
+// and MemoryUsage() (ComponentComsolCached, ComponentSuperposition). With
+// settings.nThreads = 0, the number of copies is capped so that they use at
+// most half of the available memory. Returns an empty vector on failure.
+template <typename T>
+inline std::vector<std::unique_ptr<T> > makeWorkerCopies(
+    Settings& settings, const T& model, Garfield::Medium* medium) {
+  settings.workerModels.clear();
+  settings.workerModelBytes = model.MemoryUsage();
+  size_t n = settings.nThreads;
+  if (n == 0) {
+    n = std::max(1u, std::thread::hardware_concurrency());
+    const double available = double(sysconf(_SC_AVPHYS_PAGES)) *
+                             double(sysconf(_SC_PAGESIZE));
+    const size_t fit = size_t(0.5 * available /
+                              std::max<size_t>(settings.workerModelBytes, 1));
+    if (available > 0. && fit < n) {
+      n = std::max<size_t>(fit, 1);
+      std::cout << "DriftEngine: Memory for " << n << " model copies only; "
+                << "using " << n << " threads.\n";
+    }
+  }
+  std::vector<std::unique_ptr<T> > copies;
+  for (size_t k = 0; k < n; ++k) {
+    copies.emplace_back(new T());
+    if (!copies.back()->CopyFrom(model)) {
+      std::cerr << "DriftEngine::makeWorkerCopies: Cannot copy the model.\n";
+      settings.workerModels.clear();
+      return {};
+    }
+    copies.back()->SetGas(medium);
+    settings.workerModels.push_back(copies.back().get());
+  }
+  return copies;
+}
+
+// Start and end point of one drifted electron.
+struct Electron {
+  int track;
+  double x0, y0, z0, t0;
+  double x1, y1, z1, t1;
+  int status;
+};
+
+// Uniform point in a disk of radius radiusCathode / 3 around the axis.
+inline std::pair<double, double> randInCircle(std::mt19937& gen) {
+  double radiusCathode = 0.5; //[cm]
+  double radiusElectrons = radiusCathode / 3.0;
+
+  std::uniform_real_distribution<double> dist_angle(0, 2 * M_PI);
+  std::uniform_real_distribution<double> dist_radius(0, 1);
+
+  double theta = dist_angle(gen);
+  double r = radiusElectrons * std::sqrt(dist_radius(gen));
+
+  return {r * std::cos(theta), r * std::sin(theta)};
+}
+
+// Independent, reproducible stream for track i.
+inline std::mt19937 trackStream(const unsigned int seed, const int i) {
+  std::seed_seq seq{seed, static_cast<unsigned int>(i), 0x50554d41u};
+  return std::mt19937(seq);
+}
+
+// Generates the ionisation clusters of all tracks. Heed draws from the
+// global Garfield random engine, so this part runs on one thread; the
+// engine is reseeded per track to keep each track independent of the
+// others.
+inline std::vector<Electron> generateClusters(Garfield::Component& model,
+                                              const Settings& settings) {
+  Garfield::Sensor sensor;
+  sensor.AddComponent(&model);
+  sensor.SetArea(settings.area[0], settings.area[1], settings.area[2],
+                 settings.area[3], settings.area[4], settings.area[5]);
+
+  Garfield::TrackHeed trackHeed;
+  trackHeed.SetParticle(settings.particle);
+  trackHeed.SetSensor(&sensor);
+
+  std::vector<Electron> electrons;
+  for (int i = 0; i < settings.nTracks; i++) {
+    auto gen = trackStream(settings.seed, i);
+    auto [x0, y0] = randInCircle(gen); //[cm]
+    Garfield::randomEngine.Seed(gen());
+    if (settings.debug) {
+      std::cout << "x0, y0, z0: " << x0 << ", " << y0 << ", "
+                << settings.z0 << std::endl;
+    }
+    trackHeed.NewTrack(x0, y0, settings.z0, 0, 0, 1, settings.energy);
+
+    double xc, yc, zc, tc;
+    int nc, nsec;
+    double ec, esec;
+    while (trackHeed.GetCluster(xc, yc, zc, tc, nc, nsec, ec, esec)) {
+      for (int j = 0; j < nc; ++j) {
+        electrons.push_back({i, xc, yc, zc, tc, 0, 0, 0, 0, 0});
+      }
+    }
+  }
+  return electrons;
+}
+
+// Fills hSpeed with the average speed of an electron [cm/us].
+inline void fillSpeed(TH1F* hSpeed, const Electron& e) {
+  double dx = e.x1 - e.x0;
+  double dy = e.y1 - e.y0;
+  double dz = e.z1 - e.z0;
+  double distance = std::sqrt(dx * dx + dy * dy + dz * dz); // cm
+  double time = e.t1 - e.t0; // ns
+  if (time > 0) hSpeed->Fill(distance / time * 1e3); // cm/ns -> cm/us
+}
+
+// Copies the points of the last drift line into points.
+inline void getPoints(const Garfield::DriftLineRKF& drift,
+                      std::vector<TrackRecorder::Point>& points) {
+  const size_t np = drift.GetNumberOfDriftLinePoints();
+  points.resize(np);
+  for (size_t j = 0; j < np; ++j) {
+    auto& p = points[j];
+    drift.GetDriftLinePoint(j, p[1], p[2], p[3], p[0]);
+  }
+}
+
+// Drifts the given electrons through the model on settings.nThreads
+// threads and fills in their end points. Fills hSpeed (if given), adds the
+// drift lines to driftView (if given) in electron order, streams them to
+// recorder (if given) and adds their induced currents to signals (if
+// given). driftView keeps every line in memory until the end; for long
+// runs use the recorder and ReplayTracks instead.
+inline void driftElectrons(Garfield::Component& model,
+                           const Settings& settings,
+                           std::vector<Electron>& electrons, TH1F* hSpeed,
+                           Garfield::ViewDrift* driftView = nullptr,
+                           TrackRecorder* recorder = nullptr,
+                           SignalSynthesis::Accumulator* signals = nullptr) {
+  ROOT::EnableThreadSafety();
+  const size_t nElectrons = electrons.size();
+  if (nElectrons == 0) return;
+
+  const unsigned int nThreads =
+      std::min<size_t>(threadCount(settings), nElectrons);
+
+  // Thread-local histograms, merged once all workers are done. They are
+  // kept out of the current directory, without changing the caller's
+  // setting.
+  std::vector<TH1F*> hLocal(nThreads, nullptr);
+  if (hSpeed) {
+    const Bool_t addDirectory = TH1::AddDirectoryStatus();
+    TH1::AddDirectory(kFALSE);
+    for (unsigned int k = 0; k < nThreads; ++k) {
+      const std::string name = std::string("hSpeed_") + std::to_string(k);
+      hLocal[k] = static_cast<TH1F*>(hSpeed->Clone(name.c_str()));
+      hLocal[k]->Reset();
+    }
+    TH1::AddDirectory(addDirectory);
+  }
+
+  // Drift line points, only kept when plotting.
+  std::vector<std::vector<std::array<float, 3> > > lines;
+  if (driftView) lines.resize(nElectrons);
+
+  // One signal workspace per thread, merged in thread order at the end.
+  if (signals) signals->SetNumberOfWorkspaces(nThreads);
+
+  // Electrons are handed out in small chunks to balance the load.
+  constexpr size_t chunk = 16;
+  std::atomic<size_t> next(0);
+  auto worker = [&](const unsigned int k) {
+    Garfield::Component& workerModel =
+        settings.workerModels.empty() ? model : *settings.workerModels[k];
+    Garfield::Sensor sensor;
+    sensor.AddComponent(&workerModel);
+    sensor.SetArea(settings.area[0], settings.area[1], settings.area[2],
+                   settings.area[3], settings.area[4], settings.area[5]);
+    Garfield::DriftLineRKF drift(&sensor);
+    std::vector<TrackRecorder::Point> points, ionPoints;
+    // Induced charge of this thread's electrons (and ions).
+    SignalSynthesis::Workspace* induced =
+        signals ? &signals->GetWorkspace(k) : nullptr;
+    const bool ions = signals && signals->GetSettings().ions;
+    for (size_t i0 = next.fetch_add(chunk); i0 < nElectrons;
+         i0 = next.fetch_add(chunk)) {
+      const size_t i1 = std::min(i0 + chunk, nElectrons);
+      for (size_t i = i0; i < i1; ++i) {
+        Electron& e = electrons[i];
+        drift.DriftElectron(e.x0, e.y0, e.z0, e.t0);
+        drift.GetEndPoint(e.x1, e.y1, e.z1, e.t1, e.status);
+        if (hLocal[k]) fillSpeed(hLocal[k], e);
+        if (!driftView && !recorder && !signals) continue;
+        getPoints(drift, points);
+        if (signals) {
+          signals->AddLine(*induced, workerModel, e.track, -1., points);
+        }
+        if (ions) {
+          drift.DriftIon(e.x0, e.y0, e.z0, e.t0);
+          getPoints(drift, ionPoints);
+          signals->AddLine(*induced, workerModel, e.track, 1., ionPoints);
+        }
+        if (recorder) recorder->Record(i, e.track, e.status, points);
+        if (!driftView) continue;
+        lines[i].resize(points.size());
+        for (size_t j = 0; j < points.size(); ++j) {
+          lines[i][j] = {float(points[j][1]), float(points[j][2]),
+                         float(points[j][3])};
+        }
+      }
+    }
+  };
+
+  std::vector<std::thread> pool;
+  for (unsigned int k = 1; k < nThreads; ++k) pool.emplace_back(worker, k);
+  worker(0);
+  for (auto& t : pool) t.join();
+  if (signals) signals->Merge();
+
+  // Bin contents are integer counts, so the merged histogram does not
+  // depend on which thread filled which entry. The floating-point sums
+  // behind the statistics box do, so recompute them from the bins.
+  for (auto h : hLocal) {
+    if (!h) continue;
+    hSpeed->Add(h);
+    delete h;
+  }
+  if (hSpeed) hSpeed->ResetStats();
+
+  if (driftView) {
+    for (const auto& line : lines) {
+      if (line.empty()) continue;
+      size_t id = 0;
+      driftView->NewDriftLine(Garfield::Particle::Electron, line.size(), id,
+                              line[0][0], line[0][1], line[0][2]);
+      for (size_t j = 0; j < line.size(); ++j) {
+        driftView->SetDriftLinePoint(id, j, line[j][0], line[j][1],
+                                     line[j][2]);
+      }
+    }
+  }
+}
+
+// Drifts all electrons of nTracks tracks through the model. Returns the
+// start and end points of every electron.
+inline std::vector<Electron> run(
+    Garfield::Component& model, const Settings& settings, TH1F* hSpeed,
+    Garfield::ViewDrift* driftView = nullptr, TrackRecorder* recorder = nullptr,
+    SignalSynthesis::Accumulator* signals = nullptr) {
+  std::vector<Electron> electrons = generateClusters(model, settings);
+  std::cout << "Drifting " << electrons.size() << " electrons from "
+            << settings.nTracks << " tracks\n";
+  const auto t0 = std::chrono::steady_clock::now();
+  driftElectrons(model, settings, electrons, hSpeed, driftView, recorder,
+                 signals);
+  // Rerun with different settings.nThreads to measure the scaling.
+  const double s = std::chrono::duration<double>(
+                       std::chrono::steady_clock::now() - t0).count();
+  std::cout << "Drifted " << electrons.size() << " electrons in " << s
+            << " s on " << threadCount(settings) << " threads ("
+            << (s > 0. ? electrons.size() / s : 0.) << " /s)\n";
+  if (!settings.workerModels.empty()) {
+    std::cout << "    " << settings.workerModels.size()
+              << " model copies of about "
+              << settings.workerModelBytes / (1024. * 1024.) << " MB each\n";
+  }
+  return electrons;
+}
+
+// Adds the drift lines of electrons 0 to maxLines - 1 from a TrackRecorder
+// file to driftView. They are picked by electron index, not file order, so
+// the plot does not depend on the number of threads. Returns the number of
+// lines added.
+inline size_t replay(const std::string& file, Garfield::ViewDrift& driftView,
+                     const size_t maxLines = 1000) {
+  TrackReader reader(file);
+  TrackReader::Line line;
+  size_t n = 0;
+  while (n < maxLines && reader.Next(line)) {
+    if (line.electron >= maxLines) continue;
+    size_t id = 0;
+    driftView.NewDriftLine(Garfield::Particle::Electron, line.t.size(), id,
+                           line.x[0], line.y[0], line.z[0]);
+    for (size_t j = 0; j < line.t.size(); ++j) {
+      driftView.SetDriftLinePoint(id, j, line.x[j], line.y[j], line.z[j]);
+    }
+    ++n;
+  }
+  return n;
+}
+
+}  // namespace DriftEngine
+
+#endif
@@ -0,0 +1,357 @@
+#ifndef GAS_TABLE_CACHE_HH
+#define GAS_TABLE_CACHE_HH
+
+// Shared cache of Magboltz gas tables, and a parallel, resumable builder.
+//
+// A table is identified by its composition, temperature, pressure, field
+// grid and number of collisions, and stored as <key>.gas in the cache
+// directory ($PUMA_GAS_CACHE, or ~/.cache/puma_gas). So every program finds
+// the same table whatever its working directory.
+//
+// A missing table is built by splitting the E-field grid over worker
+// processes. Each field point is written to its own file as soon as it is
+// done, so an interrupted build resumes from the finished points. The
+// points are then merged into one table. Builds of the same table are
+// serialised by a lock file (<key>.lock), so concurrent jobs build it once.
+//
+// Existing tables (e.g. argon_table.gas) can be imported; they are loaded
+// and only accepted if their gas, temperature, pressure and field grid
+// match the spec.
+//
+// Usage:
+//   MediumMagboltz gas;
+//   gas.SetComposition("Ar", 100.);
+//   gas.SetTemperature(293.15);
+//   gas.SetPressure(760.);
+//   if (!GasTableCache::loadOrBuild(gas, 0, "argon_table.gas")) return 1;
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "Garfield/MediumMagboltz.hh"
+
+namespace GasTableCache {
+
+struct Spec {
+  std::vector<std::pair<std::string, double> > composition;
+  double temperature = 293.15;  // [K]
+  double pressure = 760.;       // [Torr]
+  // E-field grid [V/cm], Garfield's default.
+  double emin = 100.;
+  double emax = 100000.;
+  size_t nE = 20;
+  bool logE = true;
+  int nColl = 5;  // collisions / 1e7 per field point
+
+  std::vector<double> Fields() const {
+    std::vector<double> e(nE, emin);
+    for (size_t i = 1; i < nE; ++i) {
+      const double f = double(i) / (nE - 1);
+      e[i] = logE ? emin * std::pow(emax / emin, f) : emin + f * (emax - emin);
+    }
+    return e;
+  }
+
+  // Canonical description, e.g. "Ar:100/T293.15/P760/E100-100000x20log/c5".
+  std::string Description() const {
+    std::string s;
+    char buf[128];
+    for (const auto& c : composition) {
+      std::snprintf(buf, sizeof(buf), "%s:%.6g/", c.first.c_str(), c.second);
+      s += buf;
+    }
+    std::snprintf(buf, sizeof(buf), "T%.6g/P%.6g/E%.6g-%.6gx%zu%s/c%d",
+                  temperature, pressure, emin, emax, nE, logE ? "log" : "lin",
+                  nColl);
+    return s + buf;
+  }
+
+  std::string Key() const {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (const unsigned char c : Description()) {
+      h = (h ^ c) * 0x100000001b3ULL;
+    }
+    char buf[20];
+    std::snprintf(buf, sizeof(buf), "%016llx",
+                  static_cast<unsigned long long>(h));
+    return buf;
+  }
+};
+
+// Spec of the composition, temperature and pressure set in gas.
+inline Spec specOf(Garfield::MediumGas& gas) {
+  Spec spec;
+  std::string g[6];
+  double f[6];
+  gas.GetComposition(g[0], f[0], g[1], f[1], g[2], f[2], g[3], f[3], g[4],
+                     f[4], g[5], f[5]);
+  for (size_t i = 0; i < 6; ++i) {
+    if (!g[i].empty() && f[i] > 0.) spec.composition.push_back({g[i], f[i]});
+  }
+  spec.temperature = gas.GetTemperature();
+  spec.pressure = gas.GetPressure();
+  return spec;
+}
+
+inline std::string cacheDirectory() {
+  const char* env = std::getenv("PUMA_GAS_CACHE");
+  if (env && *env) return env;
+  const char* home = std::getenv("HOME");
+  return std::string(home && *home ? home : ".") + "/.cache/puma_gas";
+}
+
+inline std::string cachePath(const Spec& spec) {
+  return cacheDirectory() + "/" + spec.Key() + ".gas";
+}
+
+// Name for a temporary file next to file, unique to this process.
+inline std::string tmpPath(const std::string& file) {
+  return file + "." + std::to_string(getpid()) + ".tmp";
+}
+
+// Exclusive lock on <key>.lock in the cache directory, held until
+// destruction.
+class Lock {
+ public:
+  explicit Lock(const Spec& spec) {
+    const std::string file = cacheDirectory() + "/" + spec.Key() + ".lock";
+    m_fd = open(file.c_str(), O_RDWR | O_CREAT, 0666);
+    if (m_fd < 0 || flock(m_fd, LOCK_EX) != 0) {
+      std::cerr << "GasTableCache: Cannot lock " << file << ".\n";
+    } else {
+      m_locked = true;
+    }
+  }
+  ~Lock() {
+    if (m_fd >= 0) close(m_fd);
+  }
+  Lock(const Lock&) = delete;
+  Lock& operator=(const Lock&) = delete;
+
+  bool IsLocked() const { return m_locked; }
+
+ private:
+  int m_fd = -1;
+  bool m_locked = false;
+};
+
+// Checks that a loaded table was made for spec; prints the first mismatch.
+inline bool matches(Garfield::MediumMagboltz& gas, const Spec& spec,
+                    const std::string& file) {
+  auto near = [](const double a, const double b, const double tol) {
+    return std::abs(a - b) <= tol * std::max(std::abs(a), std::abs(b));
+  };
+  auto mismatch = [&](const std::string& what) {
+    std::cerr << "GasTableCache: " << file << " does not match "
+              << spec.Description() << " (" << what << ").\n";
+    return false;
+  };
+  const Spec found = specOf(gas);
+  if (found.composition.size() != spec.composition.size()) {
+    return mismatch("composition");
+  }
+  for (size_t i = 0; i < spec.composition.size(); ++i) {
+    if (found.composition[i].first != spec.composition[i].first ||
+        !near(found.composition[i].second, spec.composition[i].second,
+               1.e-6)) {
+      return mismatch("composition");
+    }
+  }
+  if (!near(found.temperature, spec.temperature, 1.e-6)) {
+    return mismatch("temperature");
+  }
+  if (!near(found.pressure, spec.pressure, 1.e-6)) {
+    return mismatch("pressure");
+  }
+  // Gas files store E/p with 9 digits.
+  std::vector<double> efields, bfields, angles;
+  gas.GetFieldGrid(efields, bfields, angles);
+  const std::vector<double> fields = spec.Fields();
+  if (efields.size() != fields.size()) return mismatch("field grid");
+  for (size_t i = 0; i < fields.size(); ++i) {
+    if (!near(efields[i], fields[i], 1.e-6)) return mismatch("field grid");
+  }
+  if (bfields.size() != 1 || bfields[0] != 0.) return mismatch("B field");
+  return true;
+}
+
+inline void configure(Garfield::MediumMagboltz& gas, const Spec& spec) {
+  std::string g[6];
+  double f[6] = {0., 0., 0., 0., 0., 0.};
+  for (size_t i = 0; i < spec.composition.size() && i < 6; ++i) {
+    g[i] = spec.composition[i].first;
+    f[i] = spec.composition[i].second;
+  }
+  gas.SetComposition(g[0], f[0], g[1], f[1], g[2], f[2], g[3], f[3], g[4],
+                     f[4], g[5], f[5]);
+  gas.SetTemperature(spec.temperature);
+  gas.SetPressure(spec.pressure);
+}
+
+// Computes field point i of the spec into file (in a worker process).
+inline bool buildPoint(const Spec& spec, const size_t i,
+                       const std::string& file) {
+  Garfield::MediumMagboltz gas;
+  configure(gas, spec);
+  gas.SetFieldGrid({spec.Fields()[i]}, {0.}, {0.5 * M_PI});
+  gas.GenerateGasTable(spec.nColl, false);
+  const std::string tmp = tmpPath(file);
+  if (!gas.WriteGasFile(tmp)) return false;
+  return std::rename(tmp.c_str(), file.c_str()) == 0;
+}
+
+// Builds the table of spec into the cache on nWorkers processes. If
+// another process holds the lock and builds the same table, waits for it
+// and returns.
+inline bool build(const Spec& spec, unsigned int nWorkers = 0) {
+  namespace fs = std::filesystem;
+  const std::string target = cachePath(spec);
+  const std::string parts = cacheDirectory() + "/" + spec.Key() + ".parts";
+  std::error_code ec;
+  fs::create_directories(cacheDirectory(), ec);
+  const Lock lock(spec);
+  if (!lock.IsLocked()) return false;
+  if (fs::exists(target)) return true;
+  fs::create_directories(parts, ec);
+  if (ec) {
+    std::cerr << "GasTableCache::build: Cannot create " << parts << ".\n";
+    return false;
+  }
+  std::cout << "GasTableCache::build: " << spec.Description() << "\n";
+
+  const size_t nE = spec.nE;
+  auto partFile = [&](const size_t i) {
+    return parts + "/point_" + std::to_string(i) + ".gas";
+  };
+  std::vector<size_t> todo;
+  for (size_t i = 0; i < nE; ++i) {
+    if (!fs::exists(partFile(i))) todo.push_back(i);
+  }
+  std::cout << "    " << nE - todo.size() << " of " << nE
+            << " field points already done.\n";
+
+  if (nWorkers == 0) nWorkers = std::thread::hardware_concurrency();
+  nWorkers = static_cast<unsigned int>(
+      std::max<size_t>(1, std::min<size_t>(nWorkers, todo.size())));
+  // Flush first, or the workers repeat the buffered output.
+  std::cout.flush();
+  std::fflush(nullptr);
+  std::vector<pid_t> workers;
+  for (unsigned int w = 0; w < nWorkers && !todo.empty(); ++w) {
+    const pid_t pid = fork();
+    if (pid < 0) {
+      std::cerr << "GasTableCache::build: fork failed.\n";
+      break;
+    }
+    if (pid == 0) {
+      // Worker w takes every nWorkers-th remaining point.
+      int status = 0;
+      for (size_t j = w; j < todo.size(); j += nWorkers) {
+        if (!buildPoint(spec, todo[j], partFile(todo[j]))) status = 1;
+      }
+      std::cout.flush();
+      std::fflush(nullptr);
+      _exit(status);
+    }
+    workers.push_back(pid);
+  }
+  bool ok = true;
+  for (const pid_t pid : workers) {
+    int status = 0;
+    if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) ||
+        WEXITSTATUS(status) != 0) {
+      ok = false;
+    }
+  }
+  for (size_t i = 0; i < nE; ++i) {
+    if (!fs::exists(partFile(i))) {
+      std::cerr << "GasTableCache::build: Field point " << i
+                << " missing; rerun to resume.\n";
+      ok = false;
+    }
+  }
+  if (!ok) return false;
+
+  // Merge the field points into one table.
+  Garfield::MediumMagboltz gas;
+  if (!gas.LoadGasFile(partFile(0))) return false;
+  for (size_t i = 1; i < nE; ++i) {
+    if (!gas.MergeGasFile(partFile(i), false)) {
+      std::cerr << "GasTableCache::build: Cannot merge " << partFile(i)
+                << ".\n";
+      return false;
+    }
+  }
+  const std::string tmp = tmpPath(target);
+  if (!gas.WriteGasFile(tmp) || std::rename(tmp.c_str(), target.c_str()) != 0) {
+    std::cerr << "GasTableCache::build: Cannot write " << target << ".\n";
+    return false;
+  }
+  fs::remove_all(parts, ec);
+  std::cout << "GasTableCache::build: Wrote " << target << "\n";
+  return true;
+}
+
+// Stores an existing table (e.g. argon_table.gas) in the cache as the
+// table of spec, if it matches the spec.
+inline bool import(const std::string& file, const Spec& spec) {
+  namespace fs = std::filesystem;
+  Garfield::MediumMagboltz gas;
+  if (!gas.LoadGasFile(file)) {
+    std::cerr << "GasTableCache::import: Cannot load " << file << ".\n";
+    return false;
+  }
+  if (!matches(gas, spec, file)) return false;
+  std::error_code ec;
+  fs::create_directories(cacheDirectory(), ec);
+  const std::string target = cachePath(spec);
+  const std::string tmp = tmpPath(target);
+  fs::copy_file(file, tmp, fs::copy_options::overwrite_existing, ec);
+  if (!ec) fs::rename(tmp, target, ec);
+  if (ec) {
+    std::cerr << "GasTableCache::import: " << ec.message() << "\n";
+    fs::remove(tmp, ec);
+    return false;
+  }
+  std::cout << "GasTableCache::import: " << file << " -> " << target << "\n";
+  return true;
+}
+
+// Loads the table matching the composition, temperature and pressure of
+// gas. If it is not in the cache, it is imported from the local table
+// seed (if given and matching) or built.
+inline bool loadOrBuild(Garfield::MediumMagboltz& gas,
+                        unsigned int nWorkers = 0,
+                        const std::string& seed = "") {
+  namespace fs = std::filesystem;
+  const Spec spec = specOf(gas);
+  const std::string path = cachePath(spec);
+  if (!fs::exists(path) && !seed.empty() && fs::exists(seed)) {
+    import(seed, spec);
+  }
+  if (!fs::exists(path) && !build(spec, nWorkers)) return false;
+  if (!gas.LoadGasFile(path)) {
+    std::cerr << "GasTableCache::loadOrBuild: Cannot load " << path << ".\n";
+    return false;
+  }
+  std::cout << "Gas table " << path << " (" << spec.Description() << ")\n";
+  return true;
+}
+
+}  // namespace GasTableCache
+
+#endif
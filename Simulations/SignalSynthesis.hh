@@ -0,0 +1,301 @@
+#ifndef SIGNAL_SYNTHESIS_HH
+#define SIGNAL_SYNTHESIS_HH
+
+// Induced-current waveforms in the layout of the RScan/HVScan scope files.
+//
+// By Ramo's theorem, a charge q moving from x0 to x1 induces the charge
+// -q * (phi_w(x1) - phi_w(x0)) on an electrode with weighting potential
+// phi_w. Summed over consecutive drift-line points, this gives the charge
+// induced in each time bin, i.e. the current. The weighting potentials are
+// the unit-potential solutions of ComponentSuperposition, so they are loaded
+// once per geometry together with the field.
+//
+// Each drift thread fills its own Workspace (buffer and weighting-potential
+// scratch space, kept between calls), using its own copy of the model. The
+// buffers are added up in thread order once all threads are done. Charges
+// are summed in fixed point (2^-32 e), so the sums do not depend on which
+// thread drifted which electron, and the waveforms are the same for any
+// thread count. Drift lines of track i go to event i % nEvents. Waveforms()
+// then converts the binned charge into the voltage across the load,
+//   V = -gain * R * (I * h),
+// where h is the front-end impulse response (an RC low-pass by default,
+// or any response given to SetResponse). h is normalised to unit area, so
+// the integral of V / R is the induced charge, as in the notebook's Qc and
+// Qa. The convolution uses a radix-2 FFT.
+//
+// Write() produces the scope layout read by Data Analysis/ScanAnalyzer:
+// one row with the sample interval [s], then one row per sample with
+// nEvents cathode and nEvents anode waveforms [V], tab-separated.
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <complex>
+#include <cstdint>
+#include <cstdio>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "Garfield/Component.hh"
+
+namespace SignalSynthesis {
+
+struct Settings {
+  size_t nSamples = 13999;   // samples per waveform, as the scope files
+  double dt = 2.;            // sample interval [ns]
+  double tOffset = 9000.;    // waveform time of t = 0 [ns] (sample 4500)
+  size_t nEvents = 10;       // waveforms per electrode
+  double load = 220.;        // [Ohm]
+  double gain = 1.;
+  double tau = 4.;           // RC time constant of the front end [ns]
+  double noise = 0.;         // rms noise [V]
+  bool ions = false;         // also drift an ion from each electron origin
+  unsigned int seed = 1;
+};
+
+// Induced charge [2^-32 e] per time bin, for every electrode and event.
+typedef std::vector<int64_t> Buffer;
+
+// Per-thread state for Accumulator::AddLine.
+struct Workspace {
+  Buffer buffer;
+  std::vector<double> phi0, phi1;
+};
+
+// Point (t, x, y, z) of a drift line, as TrackRecorder::Point.
+typedef std::array<double, 4> Point;
+
+// In-place radix-2 FFT; a.size() must be a power of two.
+inline void fft(std::vector<std::complex<double> >& a, const bool inverse) {
+  const size_t n = a.size();
+  for (size_t i = 1, j = 0; i < n; ++i) {
+    size_t bit = n >> 1;
+    for (; j & bit; bit >>= 1) j ^= bit;
+    j ^= bit;
+    if (i < j) std::swap(a[i], a[j]);
+  }
+  for (size_t len = 2; len <= n; len <<= 1) {
+    const double angle = (inverse ? 2. : -2.) * M_PI / len;
+    const std::complex<double> step(std::cos(angle), std::sin(angle));
+    for (size_t i = 0; i < n; i += len) {
+      std::complex<double> w(1.);
+      for (size_t k = 0; k < len / 2; ++k) {
+        const std::complex<double> u = a[i + k];
+        const std::complex<double> v = a[i + k + len / 2] * w;
+        a[i + k] = u + v;
+        a[i + k + len / 2] = u - v;
+        w *= step;
+      }
+    }
+  }
+  if (inverse) {
+    for (auto& x : a) x /= double(n);
+  }
+}
+
+// RC low-pass impulse response with unit area, sampled at dt.
+inline std::vector<double> rcResponse(const double tau, const double dt) {
+  if (tau <= 0.) return {1.};
+  std::vector<double> h;
+  for (size_t k = 0;; ++k) {
+    const double v = std::exp(-double(k) * dt / tau);
+    if (v < 1e-9) break;
+    h.push_back(v);
+  }
+  double sum = 0.;
+  for (const double v : h) sum += v;
+  for (auto& v : h) v /= sum;
+  return h;
+}
+
+class Accumulator {
+ public:
+  // electrodes are the weighting-potential labels of the drift model, e.g.
+  // {"cathode", "anode"}, in the column order of the output.
+  Accumulator(const std::vector<std::string>& electrodes,
+              const Settings& settings = Settings())
+      : m_electrodes(electrodes), m_settings(settings) {
+    m_sum.assign(BufferSize(), 0);
+    SetResponse(rcResponse(m_settings.tau, m_settings.dt));
+  }
+
+  const Settings& GetSettings() const { return m_settings; }
+
+  // Front-end impulse response sampled at dt; normalised to unit area.
+  void SetResponse(const std::vector<double>& h) {
+    double sum = 0.;
+    for (const double v : h) sum += v;
+    m_response = h;
+    if (sum != 0.) {
+      for (auto& v : m_response) v /= sum;
+    }
+  }
+
+  // Makes sure there are n empty workspaces. Call before the drift
+  // threads start; thread k then uses GetWorkspace(k).
+  void SetNumberOfWorkspaces(const size_t n) {
+    if (m_workspaces.size() >= n) return;
+    const size_t ne = m_electrodes.size();
+    m_workspaces.resize(n);
+    for (auto& ws : m_workspaces) {
+      ws.buffer.resize(BufferSize(), 0);
+      ws.phi0.resize(ne);
+      ws.phi1.resize(ne);
+    }
+  }
+  Workspace& GetWorkspace(const size_t k) { return m_workspaces[k]; }
+
+  // Adds the charge induced by a charge q [e] along a drift line, with the
+  // weighting potentials of model (the thread's copy of the drift model).
+  void AddLine(Workspace& ws, Garfield::Component& model, const size_t event,
+               const double q, const std::vector<Point>& points) const {
+    const size_t np = points.size();
+    if (np < 2) return;
+    const size_t ne = m_electrodes.size();
+    const size_t w = event % m_settings.nEvents;
+    for (size_t e = 0; e < ne; ++e) {
+      ws.phi0[e] = WeightingPotential(model, points[0], e);
+    }
+    for (size_t j = 1; j < np; ++j) {
+      for (size_t e = 0; e < ne; ++e) {
+        ws.phi1[e] = WeightingPotential(model, points[j], e);
+        const double dq = -q * (ws.phi1[e] - ws.phi0[e]);
+        if (dq != 0.) {
+          Deposit(
+              &ws.buffer[(e * m_settings.nEvents + w) * m_settings.nSamples],
+              points[j - 1][0], points[j][0], dq);
+        }
+      }
+      std::swap(ws.phi0, ws.phi1);
+    }
+  }
+
+  // Adds the workspace buffers to the total, in workspace order, and
+  // empties them. Call once the drift threads have finished.
+  void Merge() {
+    const size_t n = m_sum.size();
+    int64_t* sum = m_sum.data();
+    for (auto& ws : m_workspaces) {
+      int64_t* b = ws.buffer.data();
+      for (size_t i = 0; i < n; ++i) {
+        sum[i] += b[i];
+        b[i] = 0;
+      }
+    }
+  }
+
+  void Clear() { std::fill(m_sum.begin(), m_sum.end(), 0); }
+
+  // Voltage waveforms [V], electrode-major: waveform e * nEvents + event.
+  std::vector<std::vector<double> > Waveforms() const {
+    const size_t n = m_settings.nSamples;
+    const size_t nh = m_response.size();
+    size_t nfft = 1;
+    while (nfft < n + nh - 1) nfft <<= 1;
+    std::vector<std::complex<double> > hf(nfft, 0.);
+    for (size_t k = 0; k < nh; ++k) hf[k] = m_response[k];
+    fft(hf, false);
+
+    // Charge per bin [e] to volts: e / dt [A] times the load and gain.
+    const double scale =
+        -m_settings.gain * m_settings.load * kElectronCharge /
+        (m_settings.dt * 1.e-9);
+    std::mt19937 gen(m_settings.seed);
+    std::normal_distribution<double> noise(
+        0., m_settings.noise > 0. ? m_settings.noise : 1.);
+
+    const size_t nw = m_electrodes.size() * m_settings.nEvents;
+    std::vector<std::vector<double> > v(nw, std::vector<double>(n, 0.));
+    std::vector<std::complex<double> > xf(nfft);
+    for (size_t i = 0; i < nw; ++i) {
+      std::fill(xf.begin(), xf.end(), 0.);
+      for (size_t k = 0; k < n; ++k) xf[k] = m_sum[i * n + k] / kScale;
+      fft(xf, false);
+      for (size_t k = 0; k < nfft; ++k) xf[k] *= hf[k];
+      fft(xf, true);
+      for (size_t k = 0; k < n; ++k) {
+        v[i][k] = scale * xf[k].real();
+        if (m_settings.noise > 0.) v[i][k] += noise(gen);
+      }
+    }
+    return v;
+  }
+
+  // Writes the waveforms in the scope layout.
+  bool Write(const std::string& file) const {
+    FILE* out = std::fopen(file.c_str(), "w");
+    if (!out) {
+      std::cerr << "SignalSynthesis::Write: Cannot open " << file << "\n";
+      return false;
+    }
+    const auto v = Waveforms();
+    const size_t nw = v.size();
+    bool ok = true;
+    for (size_t i = 0; i < nw && ok; ++i) {
+      ok = std::fprintf(out, i + 1 < nw ? "%G\t" : "%G\n",
+                        m_settings.dt * 1.e-9) > 0;
+    }
+    for (size_t k = 0; k < m_settings.nSamples && ok; ++k) {
+      for (size_t i = 0; i < nw && ok; ++i) {
+        ok = std::fprintf(out, i + 1 < nw ? "%.6G\t" : "%.6G\n", v[i][k]) > 0;
+      }
+    }
+    ok = (std::fclose(out) == 0) && ok;
+    if (!ok) {
+      std::cerr << "SignalSynthesis::Write: Error writing " << file << "\n";
+    }
+    return ok;
+  }
+
+ private:
+  static constexpr double kElectronCharge = 1.602176634e-19;  // [C]
+  // Fixed-point units per e.
+  static constexpr double kScale = 4294967296.;
+
+  std::vector<std::string> m_electrodes;
+  Settings m_settings;
+  std::vector<double> m_response;
+  std::vector<Workspace> m_workspaces;
+  Buffer m_sum;
+
+  size_t BufferSize() const {
+    return m_electrodes.size() * m_settings.nEvents * m_settings.nSamples;
+  }
+
+  double WeightingPotential(Garfield::Component& model, const Point& p,
+                            const size_t e) const {
+    return model.WeightingPotential(p[1], p[2], p[3], m_electrodes[e]);
+  }
+
+  static int64_t Fixed(const double q) { return std::llround(q * kScale); }
+
+  // Spreads the charge dq uniformly over the bins between t0 and t1 [ns].
+  void Deposit(int64_t* bins, const double t0, const double t1,
+               const double dq) const {
+    const double dt = m_settings.dt;
+    const double n = double(m_settings.nSamples);
+    const double a = std::max(0., (t0 + m_settings.tOffset) / dt);
+    const double b = std::min(n, (t1 + m_settings.tOffset) / dt);
+    if (b <= a) {
+      if (a < n && b >= 0.) bins[size_t(a)] += Fixed(dq);
+      return;
+    }
+    const double rate = dq / ((t1 - t0) / dt);  // charge per bin width
+    const size_t i0 = size_t(a);
+    const size_t i1 = std::min(size_t(b), m_settings.nSamples - 1);
+    if (i0 == i1) {
+      bins[i0] += Fixed(rate * (b - a));
+      return;
+    }
+    bins[i0] += Fixed(rate * (i0 + 1 - a));
+    const int64_t full = Fixed(rate);
+    for (size_t i = i0 + 1; i < i1; ++i) bins[i] += full;
+    bins[i1] += Fixed(rate * (b - i1));
+  }
+};
+
+}  // namespace SignalSynthesis
+
+#endif
@@ -0,0 +1,304 @@
+#ifndef TRACK_RECORDER_HH
+#define TRACK_RECORDER_HH
+
+// Streaming drift-line recorder.
+//
+// TrackRecorder collects drift lines from any number of threads into
+// fixed-size blocks, and a background thread writes each full block to
+// disk. At most a few blocks are held in memory at any time, however many
+// electrons are drifted. Every k-th point of a line is kept (always
+// including the first and last); a line is never split across blocks.
+//
+// Binary files start with the 8-byte tag "PUMATRK1" and a uint32 decimation
+// factor, followed by blocks of
+//   uint64 n, then columns of n values: uint32 electron, int32 track,
+//   int32 status, double t [ns], float x, y, z [cm].
+// CSV files have the columns Electron,t,x,y,z,track,status.
+//
+// Lines are written in the order the threads finish them; the electron
+// index identifies a line independently of that order. Close() reports
+// whether everything was written.
+//
+// TrackReader reads binary files back line by line, e.g. for ReplayTracks.
+
+#include <array>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace TrackIO {
+
+// Columns of a block of points.
+struct Block {
+  std::vector<uint32_t> electron;
+  std::vector<int32_t> track;
+  std::vector<int32_t> status;
+  std::vector<double> t;
+  std::vector<float> x, y, z;
+
+  size_t size() const { return t.size(); }
+  void clear() {
+    electron.clear();
+    track.clear();
+    status.clear();
+    t.clear();
+    x.clear();
+    y.clear();
+    z.clear();
+  }
+  void reserve(const size_t n) {
+    electron.reserve(n);
+    track.reserve(n);
+    status.reserve(n);
+    t.reserve(n);
+    x.reserve(n);
+    y.reserve(n);
+    z.reserve(n);
+  }
+};
+
+constexpr char kTag[8] = {'P', 'U', 'M', 'A', 'T', 'R', 'K', '1'};
+
+}  // namespace TrackIO
+
+class TrackRecorder {
+ public:
+  enum class Format { Binary, Csv };
+
+  // Point (t, x, y, z) of a drift line.
+  typedef std::array<double, 4> Point;
+
+  TrackRecorder(const std::string& file, const Format format = Format::Binary,
+                const size_t decimation = 1, const size_t blockSize = 65536)
+      : m_format(format),
+        m_decimation(decimation > 0 ? decimation : 1),
+        m_blockSize(blockSize > 0 ? blockSize : 1) {
+    m_file = std::fopen(file.c_str(), format == Format::Binary ? "wb" : "w");
+    if (!m_file) {
+      std::cerr << "TrackRecorder: Cannot open " << file << "\n";
+      m_error = true;
+      return;
+    }
+    if (m_format == Format::Binary) {
+      const uint32_t k = m_decimation;
+      Check(std::fwrite(TrackIO::kTag, 1, 8, m_file) == 8 &&
+            std::fwrite(&k, sizeof(k), 1, m_file) == 1);
+    } else {
+      Check(std::fprintf(m_file, "Electron,t,x,y,z,track,status\n") > 0);
+    }
+    m_current.reserve(m_blockSize);
+    m_writer = std::thread(&TrackRecorder::WriteLoop, this);
+  }
+
+  ~TrackRecorder() { Close(); }
+
+  TrackRecorder(const TrackRecorder&) = delete;
+  TrackRecorder& operator=(const TrackRecorder&) = delete;
+
+  bool IsOpen() const { return m_file != nullptr; }
+
+  // Adds one drift line. Safe to call from several threads.
+  void Record(const uint32_t electron, const int32_t track,
+              const int32_t status, const std::vector<Point>& points) {
+    if (!m_file || points.empty()) return;
+    std::unique_lock<std::mutex> lock(m_mutex);
+    // Wait if the writer is behind, to keep the memory bounded.
+    m_space.wait(lock, [this] { return m_queue.size() < kMaxQueued; });
+    const size_t np = points.size();
+    for (size_t i = 0; i < np; ++i) {
+      if (i % m_decimation != 0 && i + 1 != np) continue;
+      m_current.electron.push_back(electron);
+      m_current.track.push_back(track);
+      m_current.status.push_back(status);
+      m_current.t.push_back(points[i][0]);
+      m_current.x.push_back(points[i][1]);
+      m_current.y.push_back(points[i][2]);
+      m_current.z.push_back(points[i][3]);
+    }
+    if (m_current.size() >= m_blockSize) {
+      m_queue.push_back(std::move(m_current));
+      m_current = TrackIO::Block();
+      m_current.reserve(m_blockSize);
+      m_ready.notify_one();
+    }
+  }
+
+  // Writes the remaining points and closes the file. Returns false if the
+  // file could not be opened or written completely.
+  bool Close() {
+    if (!m_file) return !m_error;
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      if (m_current.size() > 0) m_queue.push_back(std::move(m_current));
+      m_current = TrackIO::Block();
+      m_done = true;
+    }
+    m_ready.notify_one();
+    m_writer.join();
+    Check(std::fclose(m_file) == 0);
+    m_file = nullptr;
+    return !m_error;
+  }
+
+ private:
+  static constexpr size_t kMaxQueued = 4;
+
+  Format m_format;
+  size_t m_decimation;
+  size_t m_blockSize;
+  FILE* m_file = nullptr;
+
+  std::mutex m_mutex;
+  std::condition_variable m_ready;
+  std::condition_variable m_space;
+  std::deque<TrackIO::Block> m_queue;
+  TrackIO::Block m_current;
+  bool m_done = false;
+  std::thread m_writer;
+  // Set on the first failed write; only touched by the writer thread while
+  // it runs.
+  bool m_error = false;
+
+  void Check(const bool ok) {
+    if (ok || m_error) return;
+    std::cerr << "TrackRecorder: Error writing the track file.\n";
+    m_error = true;
+  }
+
+  void WriteLoop() {
+    while (true) {
+      TrackIO::Block block;
+      {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_ready.wait(lock, [this] { return m_done || !m_queue.empty(); });
+        if (m_queue.empty()) return;
+        block = std::move(m_queue.front());
+        m_queue.pop_front();
+      }
+      m_space.notify_all();
+      // After an error, blocks are dropped so that Record() never blocks.
+      if (m_error) continue;
+      if (m_format == Format::Binary) {
+        WriteBinary(block);
+      } else {
+        WriteCsv(block);
+      }
+    }
+  }
+
+  template <typename T>
+  bool WriteColumn(const std::vector<T>& v) {
+    return std::fwrite(v.data(), sizeof(T), v.size(), m_file) == v.size();
+  }
+
+  void WriteBinary(const TrackIO::Block& b) {
+    const uint64_t n = b.size();
+    Check(std::fwrite(&n, sizeof(n), 1, m_file) == 1 &&
+          WriteColumn(b.electron) && WriteColumn(b.track) &&
+          WriteColumn(b.status) && WriteColumn(b.t) && WriteColumn(b.x) &&
+          WriteColumn(b.y) && WriteColumn(b.z));
+  }
+
+  void WriteCsv(const TrackIO::Block& b) {
+    bool ok = true;
+    for (size_t i = 0; ok && i < b.size(); ++i) {
+      ok = std::fprintf(m_file, "%u,%.9g,%.7g,%.7g,%.7g,%d,%d\n",
+                        b.electron[i], b.t[i], b.x[i], b.y[i], b.z[i],
+                        b.track[i], b.status[i]) > 0;
+    }
+    Check(ok);
+  }
+};
+
+class TrackReader {
+ public:
+  struct Line {
+    uint32_t electron = 0;
+    int32_t track = 0;
+    int32_t status = 0;
+    std::vector<double> t;
+    std::vector<float> x, y, z;
+  };
+
+  explicit TrackReader(const std::string& file) {
+    m_file = std::fopen(file.c_str(), "rb");
+    if (!m_file) {
+      std::cerr << "TrackReader: Cannot open " << file << "\n";
+      return;
+    }
+    char tag[8];
+    if (std::fread(tag, 1, 8, m_file) != 8 ||
+        std::memcmp(tag, TrackIO::kTag, 8) != 0 ||
+        std::fread(&m_decimation, sizeof(m_decimation), 1, m_file) != 1) {
+      std::cerr << "TrackReader: " << file << " is not a track file.\n";
+      std::fclose(m_file);
+      m_file = nullptr;
+    }
+  }
+  ~TrackReader() {
+    if (m_file) std::fclose(m_file);
+  }
+
+  TrackReader(const TrackReader&) = delete;
+  TrackReader& operator=(const TrackReader&) = delete;
+
+  bool IsOpen() const { return m_file != nullptr; }
+  uint32_t GetDecimation() const { return m_decimation; }
+
+  // Reads the next drift line; returns false at the end of the file.
+  bool Next(Line& line) {
+    if (m_pos >= m_block.size() && !ReadBlock()) return false;
+    const size_t i0 = m_pos;
+    const uint32_t e = m_block.electron[i0];
+    size_t i1 = i0;
+    while (i1 < m_block.size() && m_block.electron[i1] == e) ++i1;
+    line.electron = e;
+    line.track = m_block.track[i0];
+    line.status = m_block.status[i0];
+    line.t.assign(m_block.t.begin() + i0, m_block.t.begin() + i1);
+    line.x.assign(m_block.x.begin() + i0, m_block.x.begin() + i1);
+    line.y.assign(m_block.y.begin() + i0, m_block.y.begin() + i1);
+    line.z.assign(m_block.z.begin() + i0, m_block.z.begin() + i1);
+    m_pos = i1;
+    return true;
+  }
+
+ private:
+  FILE* m_file = nullptr;
+  uint32_t m_decimation = 1;
+  TrackIO::Block m_block;
+  size_t m_pos = 0;
+
+  template <typename T>
+  bool ReadColumn(std::vector<T>& v, const size_t n) {
+    v.resize(n);
+    return std::fread(v.data(), sizeof(T), n, m_file) == n;
+  }
+
+  bool ReadBlock() {
+    m_pos = 0;
+    m_block.clear();
+    if (!m_file) return false;
+    uint64_t n = 0;
+    if (std::fread(&n, sizeof(n), 1, m_file) != 1 || n == 0) return false;
+    const bool ok = ReadColumn(m_block.electron, n) &&
+                    ReadColumn(m_block.track, n) &&
+                    ReadColumn(m_block.status, n) && ReadColumn(m_block.t, n) &&
+                    ReadColumn(m_block.x, n) && ReadColumn(m_block.y, n) &&
+                    ReadColumn(m_block.z, n);
+    if (!ok) {
+      std::cerr << "TrackReader: Truncated block.\n";
+      m_block.clear();
+    }
+    return ok;
+  }
+};
+
+#endif
@@ -0,0 +1,123 @@
+#ifndef TRANSPARENCY_HH
+#define TRANSPARENCY_HH
+
+// Grid transparency from drifted electrons, with adaptive stopping.
+//
+// Electrons start at random points in a disk on the source plane
+// z = ejectFrom and are drifted with DriftEngine. An electron that ends at
+// an electrode or leaves the drift area below the measuring plane
+// z = measureFrom counts as transmitted; one that ends above it was stopped
+// (e.g. on the grid). Any other end status is a failed drift line.
+// Electrons are drifted in batches until the binomial uncertainty on the
+// transparency is below the target, at most nMax electrons are drifted, or
+// every drift line of a batch fails. Start points outside the drift area
+// (settings.area) are rejected: the configuration is not measured.
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <vector>
+
+#include "DriftEngine.hh"
+
+namespace Transparency {
+
+// DriftLineRKF end states.
+constexpr int kLeftDriftArea = -1;
+constexpr int kLeftDriftMedium = -5;
+
+struct StoppingRule {
+  double target = 0.005;   // binomial error on the transparency
+  size_t batchSize = 256;  // electrons per batch
+  size_t nMin = 512;       // at least this many per configuration
+  size_t nMax = 200000;    // give up at this many
+};
+
+struct Tally {
+  size_t passed = 0;
+  size_t stopped = 0;
+  size_t failed = 0;
+
+  size_t n() const { return passed + stopped; }
+  size_t drifted() const { return passed + stopped + failed; }
+  double transparency() const { return n() > 0 ? double(passed) / n() : 0.; }
+  // Binomial error, using (k + 1) / (n + 2) so that it does not vanish
+  // when no or all electrons pass.
+  double error() const {
+    const double p = (passed + 1.) / (n() + 2.);
+    return std::sqrt(p * (1. - p) / (n() + 1.));
+  }
+};
+
+// Whether (x, y, z) lies in the drift area of settings.
+inline bool inArea(const DriftEngine::Settings& settings, const double x,
+                   const double y, const double z) {
+  const double* a = settings.area;
+  return x >= a[0] && y >= a[1] && z >= a[2] && x <= a[3] && y <= a[4] &&
+         z <= a[5];
+}
+
+// Electrons per configuration reserved in the start-point streams.
+inline size_t streamStride(const StoppingRule& rule) {
+  const size_t b = std::max<size_t>(rule.batchSize, 1);
+  return (rule.nMax + b - 1) / b * b;
+}
+
+// Measures one configuration. Every batch is drifted completely before the
+// stopping rule is checked, and start points are drawn from streams keyed
+// by (settings.seed, config, electron), with disjoint ranges of electrons
+// for different configurations, so the result does not depend on the
+// thread count. Returns an empty tally if a start point is outside the
+// drift area.
+inline Tally measure(Garfield::Component& model,
+                     const DriftEngine::Settings& settings,
+                     const StoppingRule& rule, const double ejectFrom,
+                     const double measureFrom, const size_t config) {
+  Tally tally;
+  const size_t stride = streamStride(rule);
+  std::vector<DriftEngine::Electron> batch;
+  while (tally.drifted() < rule.nMax &&
+         (tally.n() < rule.nMin || tally.error() > rule.target)) {
+    const size_t n0 = tally.drifted();
+    // The last batch is trimmed so that at most nMax are drifted.
+    batch.resize(std::min(rule.batchSize, rule.nMax - n0));
+    for (size_t i = 0; i < batch.size(); ++i) {
+      auto gen = DriftEngine::trackStream(
+          settings.seed, static_cast<int>(config * stride + n0 + i));
+      auto [x0, y0] = DriftEngine::randInCircle(gen);
+      if (!inArea(settings, x0, y0, ejectFrom)) {
+        std::cerr << "Transparency::measure: Start point (" << x0 << ", "
+                  << y0 << ", " << ejectFrom
+                  << ") is outside the drift area.\n";
+        return Tally();
+      }
+      batch[i] = {int(config), x0, y0, ejectFrom, 0, 0, 0, 0, 0, 0};
+    }
+    DriftEngine::driftElectrons(model, settings, batch, nullptr);
+
+    const size_t failed0 = tally.failed;
+    for (const auto& e : batch) {
+      if (e.status != kLeftDriftArea && e.status != kLeftDriftMedium) {
+        ++tally.failed;
+      } else if (e.z1 < measureFrom) {
+        ++tally.passed;
+      } else {
+        ++tally.stopped;
+      }
+    }
+    if (settings.debug) {
+      std::cout << "  " << tally.drifted() << " electrons: T = "
+                << tally.transparency() << " +/- " << tally.error() << "\n";
+    }
+    if (tally.failed - failed0 == batch.size()) {
+      std::cerr << "Transparency::measure: All " << batch.size()
+                << " drift lines of a batch failed; giving up.\n";
+      break;
+    }
+  }
+  return tally;
+}
+
+}  // namespace Transparency
+
+#endif